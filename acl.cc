@@ -8,123 +8,304 @@
 
 #include <ctime>
 
-#include <map>
+#include <utility>
 #include <vector>
 
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <dolphinconn/connection.h>
 #include <dolphinconn/resultset.h>
 #include <event.h>
 #include <evutil.h>
 
+#include "connection_pool.h"
+#include "reloader.h"
+#include "thread/mutex.h"
+#include "wildcard_index.h"
+#include "lru_cache.h"
 #include "config.h"
 #include "utils.h"
 #include "log.h"
 
 typedef std::pair<std::string, std::string> bar_pair;
-typedef std::vector<bar_pair> foo_vector;
-typedef std::map<bar_pair, bool> foo_map;
+typedef LruCache<bar_pair, bool> foo_cache;
 
-static foo_vector allowed;
-static foo_vector denied;
-static foo_map cache;
+namespace {
 
-static struct event ev_refresh;
+// The localim/remoteim pairs of one action: the remoteim patterns of each
+// localim pattern, both indexed.
+class RuleIndex {
+ public:
+  void add(const std::string& user, const std::string& who) {
+    size_t id = users_.add(user);
+    if (id >= buddies_.size())
+      buddies_.resize(id + 1);
+    buddies_[id].add(who);
+  }
 
-static bool load_acl(foo_vector& goodness, foo_vector& badness) {
-  Config& config = Config::instance();
-  boost::scoped_ptr<dolphinconn::Connection> db(new dolphinconn::Connection);
-  if (!db->open(config["db_name"], config["db_user"], config["db_password"],
-        config["db_host"], config.getint("db_port"), config["db_socket"])) {
-    log_warn("MySQL error %d, SQLState %s: %s", db->get_last_errno(),
-             db->get_sqlstate(), db->get_error_msg());
+  bool matches(const std::string& user, const std::string& who) const {
+    std::vector<size_t> ids;
+    users_.find(user, ids);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      if (buddies_[ids[i]].matches(who))
+        return true;
+    }
     return false;
   }
 
-  boost::scoped_ptr<dolphinconn::ResultSet> res(db->execute_query("SELECT "
-        "localim, remoteim, action FROM acls"));
+  bool empty() const { return users_.size() == 0; }
+
+ private:
+  WildcardIndex users_;
+  std::vector<WildcardIndex> buddies_;
+};
+
+struct AclRules {
+  AclRules() : generation(0) {}
+
+  RuleIndex allowed;
+  RuleIndex denied;
+  // one more with every reload
+  uint64_t generation;
+};
+
+struct AclRow {
+  AclRow(const std::string& l, const std::string& r, bool a)
+      : localim(l), remoteim(r), allow(a) {}
+
+  std::string localim;
+  std::string remoteim;
+  bool allow;
+};
+
+// What a reload read: all the acls, or only those added since |rules|
+// were loaded.
+struct AclChanges {
+  AclChanges() : incremental(false) {}
+
+  std::string fp;
+  bool incremental;
+  std::vector<AclRow> rows;
+};
+
+// A share of the cached decisions, picked by the hash of the pair, so that
+// the workers seldom wait for each other.
+struct CacheShard {
+  CacheShard() : generation(0) {}
+
+  Mutex mutex;
+  boost::scoped_ptr<foo_cache> cache;
+  // of the rules the entries were computed with
+  uint64_t generation;
+};
+
+}  // namespace
+
+typedef boost::shared_ptr<const AclRules> AclPointer;
+
+// Replaced as a whole by every reload, the workers never see a half-built
+// index.
+static AclPointer rules(new AclRules);
+
+static const size_t kCacheShards = 16;
+static CacheShard shards[kCacheShards];
+
+static const char* const kAclFingerprintSql = "SELECT COUNT(*), MAX(id), "
+    "BIT_XOR(CRC32(CONCAT_WS(':', id, localim, remoteim, action))) FROM acls";
+
+// of the acls |rules| were loaded from; only used by the reloads
+static std::string rules_fp;
+
+static struct event ev_refresh;
+static int refresh_interval = 120;
+
+static bool load_acl(dolphinconn::Connection& db, const std::string& where,
+                     std::vector<AclRow>& rows) {
+  boost::scoped_ptr<dolphinconn::ResultSet> res(db.execute_query("SELECT "
+        "localim, remoteim, action FROM acls" + where));
   if (!res)
     return false;
 
-  bar_pair bar;
   while (res->step()) {
-    bar.first = res->column_string(0);
-    bar.second = res->column_string(1);
-    if (res->column_int(2) == 1)
-      goodness.push_back(bar);
+    rows.push_back(AclRow(res->column_string(0), res->column_string(1),
+                          res->column_int(2) == 1));
+  }
+
+  return true;
+}
+
+// Reads the acls if they changed since |rules| were loaded; false if they
+// didn't or can't be read.
+static bool read_changes(dolphinconn::Connection& db, AclChanges& changes) {
+  changes.fp = utils::table_fingerprint(db, kAclFingerprintSql);
+  if (changes.fp.empty())
+    return false;
+
+  if (changes.fp == rules_fp) {
+    DLOG(1, "acls unchanged");
+    return false;
+  }
+
+  uint32_t old_max = utils::fingerprint_max_id(rules_fp);
+  std::string max = boost::lexical_cast<std::string>(old_max);
+
+  // Usually rules were only added; then only the new ones are fetched.
+  changes.incremental =
+      !rules_fp.empty() && old_max < utils::fingerprint_max_id(changes.fp) &&
+      utils::table_fingerprint(db, kAclFingerprintSql +
+                               (" WHERE id <= " + max)) == rules_fp;
+
+  return load_acl(db, changes.incremental ? " WHERE id > " + max : "",
+                  changes.rows);
+}
+
+// Indexes |changes|, on top of |old| if they are only the new acls.
+static AclRules* build_rules(const AclChanges& changes, const AclRules& old) {
+  AclRules* acl = changes.incremental ? new AclRules(old) : new AclRules;
+
+  for (size_t i = 0; i < changes.rows.size(); ++i) {
+    const AclRow& row = changes.rows[i];
+    if (row.allow)
+      acl->allowed.add(row.localim, row.remoteim);
     else
-      badness.push_back(bar);
+      acl->denied.add(row.localim, row.remoteim);
   }
 
+  return acl;
+}
+
+// Returns false if the acls are unchanged or can't be read.
+static bool reload() {
+  AclChanges changes;
+  {
+    ConnectionLease conn;
+    if (!conn->connected() || !read_changes(conn->db(), changes))
+      return false;
+  }
+
+  // the connection is back in the pool while the index is built
+  const AclPointer old = boost::atomic_load(&rules);
+  AclRules* acl = build_rules(changes, *old);
+  acl->generation = old->generation + 1;
+  rules_fp = changes.fp;
+
+  // the caches drop what they hold once they see the new generation
+  boost::atomic_store(&rules, AclPointer(acl));
   return true;
 }
 
-// update everything.
+// Runs on the reloader thread, so the loops go on with the old rules
+// meanwhile.
+static void reload_acl() {
+  if (!reload())
+    return;
+
+  AclCacheStats stats = acl_cache_stats();
+  log_info("acl cache: %zu/%zu entries, %llu hits, %llu misses, "
+           "%llu evictions", stats.size, stats.capacity,
+           static_cast<unsigned long long>(stats.hits),
+           static_cast<unsigned long long>(stats.misses),
+           static_cast<unsigned long long>(stats.evictions));
+}
+
+// update what changed.
 static void refresh_acl(int fd, short event, void* arg) {
   struct timeval tv;
 
   evutil_timerclear(&tv);
-  tv.tv_sec = 120;  // TODO: hardcoded.
+  tv.tv_sec = refresh_interval;
   event_add(&ev_refresh, &tv);
 
   DLOG(1, "--== Refreshing acls ==--");
 
-  foo_vector good_patterns;
-  foo_vector bad_patterns;
-
-  if (!load_acl(good_patterns, bad_patterns))
-    return;
-
-  allowed.swap(good_patterns);
-  denied.swap(bad_patterns);
-  cache.clear();
+  Reloader::instance()->submit(reload_acl);
 }
 
 void acl_init() {
   struct timeval tv;
+  Config& config = Config::instance();
+
+  int interval = config.getint("acl_refresh_interval");
+  if (interval > 0)
+    refresh_interval = interval;
+
+  int size = config.getint("acl_cache_size");
+  if (size <= 0)
+    size = 10000;
+  for (size_t i = 0; i < kCacheShards; ++i)
+    shards[i].cache.reset(new foo_cache(size / kCacheShards + 1));
+
+  // initial load
+  reload();
 
   evtimer_set(&ev_refresh, refresh_acl, NULL);
   evutil_timerclear(&tv);
-  tv.tv_sec = 120;  // TODO: hardcoded.
+  tv.tv_sec = refresh_interval;
   event_add(&ev_refresh, &tv);
-
-  // initial load
-  load_acl(allowed, denied);
 }
 
-static bool check_deny(const std::string& user, const std::string& who) {
-  for (foo_vector::const_iterator it = allowed.begin();
-       it != allowed.end(); ++it) {
-    if (utils::match(user, it->first) &&
-        utils::match(who, it->second)) {
-      return false;
-    }
-  }
+static bool check_deny(const AclRules& acl, const std::string& user,
+                       const std::string& who) {
+  if (acl.allowed.matches(user, who))
+    return false;
 
-  for (foo_vector::const_iterator it = denied.begin();
-       it != denied.end(); ++it) {
-    if (utils::match(user, it->first) &&
-        utils::match(who, it->second)) {
-      return true;
-    }
+  return acl.denied.matches(user, who);
+}
+
+// Drops what |shard| computed with rules older than |acl|; called with the
+// shard locked.
+static void sync_shard(CacheShard& shard, const AclRules& acl) {
+  if (shard.generation < acl.generation) {
+    shard.cache->invalidate();
+    shard.generation = acl.generation;
   }
-  return false;
 }
 
 bool acl_check_deny(const std::string& user, const std::string& who) {
-  if (allowed.empty() && denied.empty())
+  const AclPointer acl = boost::atomic_load(&rules);
+  if (acl->allowed.empty() && acl->denied.empty())
     return false;
 
   bar_pair bar(user, who);
-  const foo_map::const_iterator it = cache.find(bar);
-  if (it != cache.end()) {
-    DLOG(2, "found cached result");
-    return it->second;
+  boost::hash<bar_pair> hasher;
+  CacheShard& shard = shards[hasher(bar) % kCacheShards];
+  bool ret;
+
+  {
+    MutexLocker lock(shard.mutex);
+    sync_shard(shard, *acl);
+
+    if (shard.cache->get(bar, &ret)) {
+      DLOG(2, "found cached result");
+      return ret;
+    }
   }
 
-  bool ret = check_deny(user, who);
+  // the lookup itself needs no lock
+  ret = check_deny(*acl, user, who);
 
-  cache.insert(std::make_pair(bar, ret));
+  MutexLocker lock(shard.mutex);
+  // not if the shard moved on to newer rules meanwhile
+  if (shard.generation == acl->generation)
+    shard.cache->put(bar, ret);
 
   return ret;
 }
+
+AclCacheStats acl_cache_stats() {
+  AclCacheStats stats = AclCacheStats();
+
+  for (size_t i = 0; i < kCacheShards; ++i) {
+    MutexLocker lock(shards[i].mutex);
+    const foo_cache& cache = *shards[i].cache;
+
+    stats.size += cache.size();
+    stats.capacity += cache.capacity();
+    stats.hits += cache.hits();
+    stats.misses += cache.misses();
+    stats.evictions += cache.evictions();
+  }
+  return stats;
+}
@@ -8,9 +8,20 @@
 #define ACL_H_
 #pragma once
 
+#include <stdint.h>
 #include <string>
 
+struct AclCacheStats {
+  size_t size;
+  size_t capacity;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+// Reloads run on the Reloader.
 void acl_init();
 bool acl_check_deny(const std::string& user, const std::string& who);
+AclCacheStats acl_cache_stats();
 
 #endif // ACL_H_
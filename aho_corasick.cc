@@ -0,0 +1,131 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "aho_corasick.h"
+
+#include <cctype>
+
+#include <algorithm>
+#include <deque>
+
+namespace {
+
+typedef std::pair<unsigned char, uint32_t> Edge;
+
+struct EdgeLess {
+  bool operator()(const Edge& e, unsigned char c) const {
+    return e.first < c;
+  }
+};
+
+inline unsigned char lower(char c) {
+  return tolower(static_cast<unsigned char>(c));
+}
+
+// the default delimiters of tokenizer
+inline bool is_delim(char c) {
+  unsigned char u = static_cast<unsigned char>(c);
+  return isspace(u) || ispunct(u);
+}
+
+}  // namespace
+
+AhoCorasick::AhoCorasick()
+    : nodes_(1),
+      words_(0) {
+}
+
+uint32_t AhoCorasick::child(uint32_t node, unsigned char c) const {
+  const std::vector<Edge>& next = nodes_[node].next;
+  std::vector<Edge>::const_iterator it =
+      std::lower_bound(next.begin(), next.end(), c, EdgeLess());
+  return (it != next.end() && it->first == c) ? it->second : 0;
+}
+
+bool AhoCorasick::add(const std::string& word) {
+  if (word.empty())
+    return false;
+
+  // no token has these
+  if (std::find_if(word.begin(), word.end(), is_delim) != word.end())
+    return false;
+
+  uint32_t node = 0;
+  for (size_t i = 0; i < word.size(); ++i) {
+    unsigned char c = lower(word[i]);
+
+    std::vector<Edge>& next = nodes_[node].next;
+    std::vector<Edge>::iterator it =
+        std::lower_bound(next.begin(), next.end(), c, EdgeLess());
+    if (it != next.end() && it->first == c) {
+      node = it->second;
+    } else {
+      uint32_t n = nodes_.size();
+      next.insert(it, Edge(c, n));
+      // |next| may move with nodes_
+      nodes_.push_back(Node());
+      node = n;
+    }
+  }
+
+  if (nodes_[node].length == 0)
+    ++words_;
+  nodes_[node].length = word.size();
+  return true;
+}
+
+void AhoCorasick::build() {
+  std::deque<uint32_t> queue;
+
+  for (size_t i = 0; i < nodes_[0].next.size(); ++i)
+    queue.push_back(nodes_[0].next[i].second);
+
+  while (!queue.empty()) {
+    uint32_t node = queue.front();
+    queue.pop_front();
+
+    for (size_t i = 0; i < nodes_[node].next.size(); ++i) {
+      unsigned char c = nodes_[node].next[i].first;
+      uint32_t n = nodes_[node].next[i].second;
+
+      uint32_t f = nodes_[node].fail;
+      while (f != 0 && child(f, c) == 0)
+        f = nodes_[f].fail;
+      f = child(f, c);
+
+      nodes_[n].fail = f;
+      nodes_[n].output = nodes_[f].length ? f : nodes_[f].output;
+      queue.push_back(n);
+    }
+  }
+}
+
+bool AhoCorasick::find_token(const std::string& text) const {
+  uint32_t state = 0;
+
+  for (size_t i = 0; i < text.size(); ++i) {
+    unsigned char c = lower(text[i]);
+
+    uint32_t n;
+    while ((n = child(state, c)) == 0 && state != 0)
+      state = nodes_[state].fail;
+    state = n;
+
+    // the token must end here...
+    if (i + 1 < text.size() && !is_delim(text[i + 1]))
+      continue;
+
+    uint32_t out = nodes_[state].length ? state : nodes_[state].output;
+    for (; out != 0; out = nodes_[out].output) {
+      // ...and start where the word does
+      size_t start = i + 1 - nodes_[out].length;
+      if (start == 0 || is_delim(text[start - 1]))
+        return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,59 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef AHO_CORASICK_H_
+#define AHO_CORASICK_H_
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// Case-insensitive Aho-Corasick automaton: finds any of the added words in
+// one pass over the text, however many words there are.  Words added to a
+// built (or copied) automaton take effect after the next build().
+class AhoCorasick {
+ public:
+  AhoCorasick();
+
+  // Returns false, adding nothing, if |word| is empty or has whitespace or
+  // punctuation in it: find_token() looks for whole tokens, which a word
+  // like that can never be.
+  bool add(const std::string& word);
+
+  // Computes the failure links; call once after the last add().
+  void build();
+
+  // Returns true if one of the words is a whole token of |text|, that is,
+  // neither preceded nor followed by anything but whitespace or punctuation
+  // (see tokenizer).
+  bool find_token(const std::string& text) const;
+
+  size_t size() const { return words_; }
+
+ private:
+  struct Node {
+    Node() : fail(0), output(0), length(0) { }
+
+    // sorted by character
+    std::vector<std::pair<unsigned char, uint32_t> > next;
+    uint32_t fail;
+    // the nearest node on the failure chain that ends a word
+    uint32_t output;
+    // of the word ending here, 0 if none
+    uint32_t length;
+  };
+
+  // 0 (the root) if |node| has no edge for |c|
+  uint32_t child(uint32_t node, unsigned char c) const;
+
+  std::vector<Node> nodes_;
+  size_t words_;
+};
+
+#endif  // AHO_CORASICK_H_
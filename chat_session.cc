@@ -6,54 +6,43 @@
 
 #include "chat_session.h"
 
-#include <ctime>
-#include <cassert>
-
-#include <event.h>
-#include <evutil.h>
-
 #include "connection.h"
+#include "worker.h"
+#include "config.h"
 #include "msn/msn.h"
 
+static int idle_timeout = 60;
+static uint32_t num_chats = 1;
+
+void chat_session_init() {
+  int timeout = Config::instance().getint("chat_idle_timeout");
+  if (timeout > 0)
+    idle_timeout = timeout;
+}
+
 ChatSession::ChatSession(const Connection* conn, const std::string& contact,
                          uint32_t id)
     : conn_(conn),
       contact_(contact),
+      seq_(__sync_fetch_and_add(&num_chats, 1)),
+      timeout_(timeout_cb, this),
       id_(id),
+      id_failed_(false),
       warned_(false),
       renew_(false) {
-  assert(init());
-}
-
-bool ChatSession::init() {
-  timeout_ = new event;
-  evtimer_set(timeout_, timeout_cb, this);
-
-  return set_idle_timeout(60);  // TODO: hardcoded.
-}
-
-ChatSession::~ChatSession() {
-  evtimer_del(timeout_);
-  delete timeout_;
+  set_idle_timeout(idle_timeout);
 }
 
-bool ChatSession::set_idle_timeout(int seconds) {
-  struct timeval tv;
-
-  evutil_timerclear(&tv);
-  tv.tv_sec = seconds;
-
-  if (event_add(timeout_, &tv))
-    return false;
-  return true;
+void ChatSession::set_idle_timeout(int seconds) {
+  conn_->worker->timers().schedule(&timeout_, seconds);
 }
 
 // static
-void ChatSession::timeout_cb(int fd, short flags, void* context) {
+void ChatSession::timeout_cb(void* context) {
   ChatSession* that = static_cast<ChatSession*>(context);
 
   if (that->renew()) {
-    that->set_idle_timeout(60);  // TODO: hardcoded.
+    that->set_idle_timeout(idle_timeout);
 
     that->set_renew(false);
   } else {
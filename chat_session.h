@@ -15,16 +15,17 @@
 
 #include <boost/noncopyable.hpp>
 
-struct event;
+#include "timing_wheel.h"
 
 class Connection;
 
+// A conversation on a notification server connection.  It goes away after
+// chat_idle_timeout seconds without messages.
 class ChatSession : private boost::noncopyable {
  public:
   ChatSession(const Connection* conn, const std::string& contact, uint32_t id);
-  ~ChatSession();
 
-  bool set_idle_timeout(int seconds);
+  void set_idle_timeout(int seconds);
 
   bool warned() const { return warned_; }
   void set_warned(bool value) { warned_ = value; }
@@ -33,22 +34,33 @@ class ChatSession : private boost::noncopyable {
   void set_renew(bool value) { renew_ = value; }
 
   const Connection* conn() const { return conn_; }
+  // tells this chat from a later one at the same address
+  uint32_t seq() const { return seq_; }
   const std::string& contact() const { return contact_; }
   uint32_t id() const { return id_; }
+  void set_id(uint32_t id) { id_ = id; }
 
- private:
-  bool init();
+  // The database couldn't create the conversation; its messages go on
+  // without an id.
+  bool id_failed() const { return id_failed_; }
+  void set_id_failed(bool value) { id_failed_ = value; }
 
-  static void timeout_cb(int fd, short flags, void* context);
+ private:
+  static void timeout_cb(void* context);
 
   const Connection* conn_;
   const std::string contact_;
-  event* timeout_;
-  const uint32_t id_;
+  const uint32_t seq_;
+  WheelTimer timeout_;
+  uint32_t id_;
+  bool id_failed_;
   bool warned_;
   bool renew_;
 };
 
 typedef std::map<std::string, ChatSession*> ChatMap;
 
+// Reads the idle timeout; called before the workers start.
+void chat_session_init();
+
 #endif // CHAT_SESSION_H_
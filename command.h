@@ -13,6 +13,8 @@
 #include <string>
 #include <vector>
 
+#include <event.h>
+
 #include "history/history.h"
 #include "defs.h"
 
@@ -26,18 +28,22 @@ class Command {
     CHUNKED = SET_BIT(2),
     ENCRYPTED = SET_BIT(3),
     WAITING_FOR_ACK = SET_BIT(4),
-    IGNORE = SET_BIT(5)
+    IGNORE = SET_BIT(5),
+    SUSPENDED = SET_BIT(6)
   };
 
   explicit Command(Connection* conn)
-    : payload_len(0), conn(conn), hist(NULL), trid(0), flags_(0) {}
+    : payload_len(0), raw(evbuffer_new()), line_len(0), conn(conn),
+      hist(NULL), trid(0), flags_(0) {}
 
   Command(Connection* conn, uint16_t flags)
-    : payload_len(0), conn(conn), hist(NULL), trid(0), flags_(flags) {}
+    : payload_len(0), raw(evbuffer_new()), line_len(0), conn(conn),
+      hist(NULL), trid(0), flags_(flags) {}
 
   ~Command() {
     if (hist != NULL)
       delete hist;
+    evbuffer_free(raw);
   }
 
   uint16_t flags() const { return flags_; }
@@ -49,11 +55,20 @@ class Command {
   bool is_encrypted() const { return flags_ & ENCRYPTED; }
   bool should_send_ack() const { return flags_ & WAITING_FOR_ACK; }
   bool should_ignore() const { return flags_ & IGNORE; }
+  bool is_suspended() const { return flags_ & SUSPENDED; }
 
   std::vector<std::string> args;
+  // only filled, in one go, once the whole payload is in and only if a
+  // handler reads it
   std::string payload;
+  // still to come
   size_t payload_len;
 
+  // the command as it came in, relayed unless it is filtered; the payload
+  // follows the first |line_len| bytes
+  struct evbuffer* raw;
+  size_t line_len;
+
   std::string cookie;
 
   Connection* conn;
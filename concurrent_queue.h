@@ -8,16 +8,20 @@
 #define CONCURRENT_QUEUE_H_
 #pragma once
 
+#include <time.h>
+
 #include <deque>
+#include <vector>
 
 #include "thread/condition.h"
 #include "thread/mutex.h"
 
-// helper class implemented as a blocking queue
+// helper class implemented as a blocking queue; a |capacity| of 0 leaves
+// it unbounded
 template <typename T>
 class ConcurrentQueue {
  public:
-  ConcurrentQueue() {}
+  explicit ConcurrentQueue(size_t capacity = 0) : capacity_(capacity) {}
 
   ~ConcurrentQueue() {
     while (!queue_.empty()) {
@@ -27,14 +31,25 @@ class ConcurrentQueue {
 
   void push(const T& t) {
     mutex_.lock();
-
-    const bool was_empty = queue_.empty();
     queue_.push_back(t);
+    mutex_.unlock();
 
+    // a pop_batch() may be waiting for more than the first item
+    condition_.signal();
+  }
+
+  // Like push(), but returns false instead if the queue is full.
+  bool try_push(const T& t) {
+    mutex_.lock();
+    if (capacity_ && queue_.size() >= capacity_) {
+      mutex_.unlock();
+      return false;
+    }
+    queue_.push_back(t);
     mutex_.unlock();
 
-    if (was_empty)
-      condition_.signal();
+    condition_.signal();
+    return true;
   }
 
   T pop() {
@@ -49,10 +64,55 @@ class ConcurrentQueue {
     return tmp;
   }
 
+  // Waits for an item, then up to |wait_ms| milliseconds for |max| items
+  // to be there, and moves what it got into |items|.  A T() (the stop
+  // marker) ends the wait early.  Unless |first_wait_ms| is negative, the
+  // wait for the first item gives up after that long, with |items| empty.
+  void pop_batch(std::vector<T>& items, size_t max, int wait_ms,
+                 int first_wait_ms = -1) {
+    MutexLocker lock(mutex_);
+    struct timespec deadline;
+
+    if (first_wait_ms < 0) {
+      while (queue_.empty()) {
+        condition_.wait(lock);
+      }
+    } else {
+      deadline_in(first_wait_ms, &deadline);
+      while (queue_.empty()) {
+        if (!condition_.wait_until(lock, deadline) && queue_.empty())
+          return;
+      }
+    }
+
+    deadline_in(wait_ms, &deadline);
+
+    while (queue_.size() < max && !(queue_.back() == T())) {
+      if (!condition_.wait_until(lock, deadline))
+        break;
+    }
+
+    while (!queue_.empty() && items.size() < max) {
+      items.push_back(queue_.front());
+      queue_.pop_front();
+    }
+  }
+
  private:
+  static void deadline_in(int ms, struct timespec* deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000L;
+    }
+  }
+
   Mutex mutex_;
   Condition condition_;
   std::deque<T> queue_;
+  size_t capacity_;
 };
 
 #endif  // CONCURRENT_QUEUE_H_
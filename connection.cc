@@ -8,34 +8,30 @@
 
 #include <unistd.h>
 
-#include <set>
-
 #include <event.h>
 #include <evutil.h>
 
 #include "msn/msn.h"
+#include "worker.h"
 #include "log.h"
 
-std::set<Connection*> connections;
-
 static uint32_t num_connections = 1;
 
 Connection::Connection(int fd)
     : session(new Session()),
+      worker(NULL),
       client_bufev(NULL),
       server_bufev(NULL),
       client_addr(0),
       server_addr(0),
       client_port(0),
       server_port(0),
-      id(num_connections++),
+      id(__sync_fetch_and_add(&num_connections, 1)),
       client_fd(fd),
       server_fd(-1),
       type(NONE) {
   cmd[0] = new Command(this);
   cmd[1] = new Command(this, Command::INBOUND);
-
-  connections.insert(this);
 }
 
 Connection::~Connection() {
@@ -63,17 +59,48 @@ Connection::~Connection() {
 
   delete session;
 
-  connections.erase(this);
+  if (worker)
+    worker->detach(this);
 }
 
 void Connection::start() {
   client_bufev = bufferevent_new(client_fd, client_read_cb, NULL,
                                  client_error_cb, this);
+  bufferevent_base_set(worker->base(), client_bufev);
   bufferevent_enable(client_bufev, EV_READ);
 
   server_bufev = bufferevent_new(server_fd, server_read_cb, NULL,
                                  server_error_cb, this);
+  bufferevent_base_set(worker->base(), server_bufev);
   bufferevent_enable(server_bufev, EV_READ);
+
+  worker->attach(this);
+}
+
+void Connection::suspend(bool inbound) {
+  bufferevent_disable(inbound ? server_bufev : client_bufev, EV_READ);
+}
+
+void Connection::resume(bool inbound) {
+  bufferevent_enable(inbound ? server_bufev : client_bufev, EV_READ);
+
+  // whatever arrived meanwhile is already buffered
+  process_input(inbound);
+}
+
+void Connection::process_input(bool inbound) {
+  struct evbuffer* input =
+      EVBUFFER_INPUT(inbound ? server_bufev : client_bufev);
+  size_t len;
+
+  while (!cmd[inbound]->is_suspended()) {
+    len = EVBUFFER_LENGTH(input);
+    if (len <= 0)
+      break;
+
+    if (msn::parse_packet(inbound, input, this) == -1)
+      evbuffer_drain(input, len);
+  }
 }
 
 // static
@@ -98,19 +125,10 @@ void Connection::client_error_cb(struct bufferevent* bufev, short error,
 // static
 void Connection::client_read_cb(struct bufferevent* bufev, void* arg) {
   Connection* conn = static_cast<Connection*>(arg);
-  struct evbuffer* input = EVBUFFER_INPUT(bufev);
-  size_t len;
 
   DLOG(2, "%s: called", __func__);
 
-  while (1) {
-    len = EVBUFFER_LENGTH(input);
-    if (len <= 0)
-      break;
-
-    if (msn::parse_packet(0, input, conn) == -1)
-      evbuffer_drain(input, len);
-  }
+  conn->process_input(false);
 }
 
 // static
@@ -135,17 +153,8 @@ void Connection::server_error_cb(struct bufferevent* bufev, short error,
 // static
 void Connection::server_read_cb(struct bufferevent* bufev, void* arg) {
   Connection* conn = static_cast<Connection*>(arg);
-  struct evbuffer* input = EVBUFFER_INPUT(bufev);
-  size_t len;
 
   DLOG(2, "%s: called", __func__);
 
-  while (1) {
-    len = EVBUFFER_LENGTH(input);
-    if (len <= 0)
-      break;
-
-    if (msn::parse_packet(1, input, conn) == -1)
-      evbuffer_drain(input, len);
-  }
+  conn->process_input(true);
 }
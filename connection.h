@@ -20,6 +20,8 @@
 
 struct bufferevent;
 
+class Worker;
+
 class Connection : private boost::noncopyable {
  public:
   enum ConnType {
@@ -30,8 +32,11 @@ class Connection : private boost::noncopyable {
 
   struct Session {
     Session()
-        : chat_id(0),
+        : policy_version(0),
+          chat_id(0),
+          rules(0),
           version(0),
+          chat_id_failed(false),
           connecting(false),
           warned(false) {}
 
@@ -39,8 +44,13 @@ class Connection : private boost::noncopyable {
     ChatMap chat_sessions;
     std::string user;
     std::string epid;
+    // |rules| is the user's rule mask as of policy |policy_version|
+    uint64_t policy_version;
     uint32_t chat_id;
+    uint32_t rules;
     uint8_t version;
+    // no |chat_id| coming, the messages go on without one
+    bool chat_id_failed;
     bool connecting;
     bool warned;
   };
@@ -50,8 +60,14 @@ class Connection : private boost::noncopyable {
 
   void start();
 
+  // Stops reading commands in one direction while one of them waits for
+  // the database, and picks up where it left off.
+  void suspend(bool inbound);
+  void resume(bool inbound);
+
   Command* cmd[2];
   Session* session;
+  Worker* worker;
 
   struct bufferevent* client_bufev;
   struct bufferevent* server_bufev;
@@ -65,6 +81,8 @@ class Connection : private boost::noncopyable {
   ConnType type;
 
  private:
+  void process_input(bool inbound);
+
   static void client_error_cb(struct bufferevent* bufev, short error,
                               void* arg);
   static void client_read_cb(struct bufferevent* bufev, void* arg);
@@ -0,0 +1,197 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "connection_pool.h"
+
+#include <cstdlib>
+
+#include <algorithm>
+
+#include <dolphinconn/connection.h>
+
+#include "statement_cache.h"
+#include "config.h"
+#include "log.h"
+
+// client errors (CR_*), i.e. the connection itself, start at 2000
+static const int kClientErrors = 2000;
+
+// Threads holding a lease besides the database threads: the history
+// consumer, the reloader and the main thread with the initial loads.
+static const int kFixedUsers = 3;
+
+PooledConnection::PooledConnection()
+    : connected_(false),
+      last_used_(0) {
+  reset();
+}
+
+PooledConnection::~PooledConnection() {
+}
+
+void PooledConnection::reset() {
+  db_.reset(new dolphinconn::Connection);
+  // a new session, whose statements are yet to be prepared
+  statements_.reset(new StatementCache);
+  connected_ = false;
+}
+
+ConnectionPool* ConnectionPool::instance_ = NULL;
+
+ConnectionPool::ConnectionPool()
+    : port_(0),
+      ping_interval_(30),
+      retry_at_(0),
+      backoff_(1),
+      max_backoff_(60) {
+  Config& config = Config::instance();
+
+  name_ = config["db_name"];
+  user_ = config["db_user"];
+  password_ = config["db_password"];
+  host_ = config["db_host"];
+  port_ = config.getint("db_port");
+  socket_ = config["db_socket"];
+
+  // One connection for every thread that takes a lease, each holding one
+  // at a time, so that a slow query never makes another thread wait.
+  int threads = config.getint("db_threads");
+  if (threads <= 0)
+    threads = 2;
+  const int needed = threads + kFixedUsers;
+
+  int size = config.getint("db_pool_size");
+  if (size <= 0) {
+    size = needed;
+  } else if (size < needed) {
+    log_warn("db_pool_size %d is below the %d threads using the pool, "
+             "using %d", size, needed, needed);
+    size = needed;
+  }
+
+  int ping = config.getint("db_ping_interval");
+  if (ping > 0)
+    ping_interval_ = ping;
+
+  int max = config.getint("db_retry_max");
+  if (max > 0)
+    max_backoff_ = max;
+
+  for (int i = 0; i < size; ++i) {
+    PooledConnection* conn = new PooledConnection;
+    all_.push_back(conn);
+    free_.push_back(conn);
+  }
+}
+
+ConnectionPool::~ConnectionPool() {
+  for (size_t i = 0; i < all_.size(); ++i)
+    delete all_[i];
+}
+
+// static
+ConnectionPool& ConnectionPool::instance() {
+  if (instance_ == NULL)
+    instance_ = new ConnectionPool;
+
+  return *instance_;
+}
+
+// static
+void ConnectionPool::destroy() {
+  delete instance_;
+  instance_ = NULL;
+}
+
+PooledConnection* ConnectionPool::acquire() {
+  PooledConnection* conn;
+
+  {
+    MutexLocker lock(mutex_);
+    while (free_.empty())
+      available_.wait(lock);
+
+    conn = free_.back();
+    free_.pop_back();
+  }
+
+  check(conn);
+  return conn;
+}
+
+void ConnectionPool::release(PooledConnection* conn) {
+  if (conn->connected_ && conn->db_->get_last_errno() >= kClientErrors) {
+    log_warn("MySQL connection lost: %s", conn->db_->get_error_msg());
+    conn->reset();
+  } else if (conn->connected_ &&
+             conn->statements_->last_errno() >= kClientErrors) {
+    log_warn("MySQL connection lost: %s", conn->statements_->error_msg());
+    conn->reset();
+  }
+  conn->last_used_ = time(NULL);
+
+  MutexLocker lock(mutex_);
+  free_.push_back(conn);
+  available_.signal();
+}
+
+void ConnectionPool::check(PooledConnection* conn) {
+  time_t now = time(NULL);
+
+  if (conn->connected_) {
+    if (now - conn->last_used_ < ping_interval_ ||
+        (conn->db_->execute("DO 1") && conn->statements_->ping()))
+      return;
+
+    log_warn("MySQL connection went away, reconnecting");
+    conn->reset();
+  }
+
+  {
+    MutexLocker lock(mutex_);
+    if (now < retry_at_)
+      return;
+
+    // the others don't try while this one does
+    retry_at_ = now + backoff_;
+  }
+
+  bool ok = connect(conn);
+
+  MutexLocker lock(mutex_);
+  if (ok) {
+    backoff_ = 1;
+    retry_at_ = 0;
+  } else {
+    backoff_ = std::min(backoff_ * 2, max_backoff_);
+    // with some jitter, so that several proxies don't retry in step
+    retry_at_ = time(NULL) + backoff_ + rand() % (backoff_ / 2 + 1);
+    log_warn("MySQL unreachable, next attempt in %ld seconds",
+             static_cast<long>(retry_at_ - time(NULL)));
+  }
+}
+
+bool ConnectionPool::connect(PooledConnection* conn) {
+  dolphinconn::Connection& db = *conn->db_;
+
+  if (!db.open(name_, user_, password_, host_, port_, socket_)) {
+    log_warn("MySQL error %d, SQLState %s: %s", db.get_last_errno(),
+             db.get_sqlstate(), db.get_error_msg());
+    conn->reset();
+    return false;
+  }
+
+  StatementCache& stmts = *conn->statements_;
+  if (!stmts.open(name_, user_, password_, host_, port_, socket_)) {
+    log_warn("MySQL error %d: %s", stmts.last_errno(), stmts.error_msg());
+    conn->reset();
+    return false;
+  }
+
+  conn->connected_ = true;
+  conn->last_used_ = time(NULL);
+  return true;
+}
@@ -0,0 +1,114 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef CONNECTION_POOL_H_
+#define CONNECTION_POOL_H_
+#pragma once
+
+#include <ctime>
+
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include "thread/condition.h"
+#include "thread/mutex.h"
+
+namespace dolphinconn {
+class Connection;
+}
+
+class StatementCache;
+
+// A connection of the pool and its prepared statements.  Whether it is
+// up is only known when it comes out of the pool.
+class PooledConnection : private boost::noncopyable {
+ public:
+  dolphinconn::Connection& db() { return *db_; }
+  StatementCache& statements() { return *statements_; }
+
+  bool connected() const { return connected_; }
+
+ private:
+  friend class ConnectionPool;
+
+  PooledConnection();
+  ~PooledConnection();
+
+  // Replaces the connection with a closed one.
+  void reset();
+
+  boost::scoped_ptr<dolphinconn::Connection> db_;
+  boost::scoped_ptr<StatementCache> statements_;
+  bool connected_;
+  time_t last_used_;
+};
+
+// The MySQL connections of the whole proxy.  A connection idle for a
+// while is pinged before it is handed out, and one that is down is
+// reconnected; while the database is unreachable the attempts back off
+// exponentially, and only one caller at a time makes them, so a failover
+// doesn't turn into a reconnect storm.
+//
+// The first instance() reads the config, so it must happen on the main
+// thread.
+class ConnectionPool : private boost::noncopyable {
+ public:
+  static ConnectionPool& instance();
+  static void destroy();
+
+  // Takes a free connection; the pool has one for every thread using it,
+  // so this only waits if a thread holds two.  It is not connected() if
+  // the database is down or backing off.
+  PooledConnection* acquire();
+  void release(PooledConnection* conn);
+
+ private:
+  ConnectionPool();
+  ~ConnectionPool();
+
+  // Makes sure |conn| is up, as far as the back-off lets it.
+  void check(PooledConnection* conn);
+  bool connect(PooledConnection* conn);
+
+  static ConnectionPool* instance_;
+
+  Mutex mutex_;
+  Condition available_;
+  std::vector<PooledConnection*> all_;
+  std::vector<PooledConnection*> free_;
+
+  std::string name_;
+  std::string user_;
+  std::string password_;
+  std::string host_;
+  int port_;
+  std::string socket_;
+
+  int ping_interval_;
+
+  // no reconnect before |retry_at_|, which each failure pushes further
+  time_t retry_at_;
+  int backoff_;
+  int max_backoff_;
+};
+
+// Holds a connection of the pool for its scope.
+class ConnectionLease : private boost::noncopyable {
+ public:
+  ConnectionLease() : conn_(ConnectionPool::instance().acquire()) { }
+  ~ConnectionLease() { ConnectionPool::instance().release(conn_); }
+
+  PooledConnection& operator*() const { return *conn_; }
+  PooledConnection* operator->() const { return conn_; }
+
+ private:
+  PooledConnection* conn_;
+};
+
+#endif  // CONNECTION_POOL_H_
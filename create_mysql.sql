@@ -118,6 +118,14 @@ CREATE TABLE IF NOT EXISTS conversations (
 	FOREIGN KEY (user_id) REFERENCES users(id)
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8;
 
+CREATE TABLE IF NOT EXISTS conversation_ids (
+	id TINYINT UNSIGNED NOT NULL,
+	next_id INT UNSIGNED NOT NULL,
+	PRIMARY KEY (id)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8;
+
+INSERT IGNORE INTO conversation_ids (id, next_id) VALUES (1, 1);
+
 CREATE TABLE IF NOT EXISTS messages (
 	id BIGINT UNSIGNED NOT NULL AUTO_INCREMENT,
 	timestamp DATETIME NOT NULL,
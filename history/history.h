@@ -61,10 +61,19 @@ class History {
     return type_to_text(type());
   }
 
+  time_t raw_timestamp() const {
+    return timestamp_;
+  }
+
+  void set_raw_timestamp(time_t t) {
+    timestamp_ = t;
+  }
+
   std::string timestamp() {
     char date[64];
+    struct tm tm;
     strftime(date, sizeof(date),
-             "%Y-%m-%d %H:%M:%S", localtime(&timestamp_));
+             "%Y-%m-%d %H:%M:%S", localtime_r(&timestamp_, &tm));
     return std::string(date);
   }
 
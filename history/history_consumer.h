@@ -10,63 +10,79 @@
 
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <dolphinconn/connection.h>
 
-#include "concurrent_queue.h"
+#include "connection_pool.h"
+#include "mpsc_ring.h"
 #include "thread/thread.h"
 #include "history/history.h"
+#include "history/history_spool.h"
 #include "config.h"
 #include "log.h"
 
 class HistoryConsumer : public Thread {
  public:
-  typedef ConcurrentQueue<History*> HistoryQueue;
+  typedef MpscRing<History*> HistoryQueue;
 
-  explicit HistoryConsumer(HistoryQueue& queue)
-      : queue_(queue) {}
+  HistoryConsumer(HistoryQueue& queue, HistorySpool& spool)
+      : queue_(queue),
+        spool_(spool),
+        batch_size_(100),
+        batch_wait_(500) {
+    Config& config = Config::instance();
+
+    int size = config.getint("history_batch_size");
+    if (size > 0)
+      batch_size_ = size;
+
+    int wait = config.getint("history_batch_wait");
+    if (wait > 0)
+      batch_wait_ = wait;
+  }
 
   void run() {
-    dolphinconn::Connection db;
+    std::vector<History*> batch;
 
-    std::ostringstream sql;
+    for (;;) {
+      batch.clear();
+      // With something spooled, the wait gives up now and then, so that a
+      // quiet proxy replays it too.
+      queue_.pop_batch(batch, batch_size_, batch_wait_,
+                       spool_.pending() ? batch_wait_ : -1);
+
+      bool quit_loop = false;
+      for (size_t i = 0; i < batch.size(); ++i) {
+        if (batch[i] == NULL) {
+          quit_loop = true;
+          batch.resize(i);
+          break;
+        }
+      }
 
-    Config& config = Config::instance();
-    bool ok = db.open(
-        config["db_name"], config["db_user"], config["db_password"],
-        config["db_host"], config.getint("db_port"), config["db_socket"]);
+      {
+        // while the database is down the pool backs off, and the batches
+        // go to the spool
+        ConnectionLease conn;
+        bool up = conn->connected();
 
-    if (!ok) {
-      log_warn("MySQL error %d, SQLState %s: %s", db.get_last_errno(),
-               db.get_sqlstate(), db.get_error_msg());
-    }
+        if (!batch.empty() && (!up || !write(conn->db(), batch))) {
+          spool(batch);
+          up = false;
+        }
 
-    for (;;) {
-      History* hist = queue_.pop();
+        delete_all(batch);
 
-      bool quit_loop = hist == NULL;
-      if (quit_loop)
-        break;
+        // what the loops couldn't queue, after the batch that was ahead
+        spool_.write_deferred();
 
-      if (ok) {
-        sql.str("");
-
-        sql << "INSERT INTO messages(timestamp, conversation_id, clientip, ";
-        sql << "inbound, type, localim, remoteim, filtered, content) VALUES ('";
-        sql << hist->timestamp() << "', ";
-        sql << hist->conversation_id() << ", ";
-        sql << hist->address() << ", ";
-        sql << hist->is_inbound() << ", ";
-        sql << hist->type() << ", '";
-        sql << hist->local_im() << "', '";
-        sql << hist->remote_im() << "', ";
-        sql << hist->is_filtered() << ", '";
-        sql << db.escape(hist->data()) << "')";
-
-        db.execute(sql.str());
+        if (up)
+          replay(conn->db());
       }
 
-      delete hist;
+      if (quit_loop)
+        break;
     }
   }
 
@@ -75,7 +91,87 @@ class HistoryConsumer : public Thread {
   }
 
  private:
+  // Returns false if the database went away; a batch MySQL refused for
+  // any other reason is dropped.
+  bool write(dolphinconn::Connection& db,
+             const std::vector<History*>& batch) {
+    sql_.str("");
+
+    // one statement, so the whole batch is a single transaction
+    sql_ << "INSERT INTO messages(timestamp, conversation_id, clientip, ";
+    sql_ << "inbound, type, localim, remoteim, filtered, content) VALUES ";
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+      History* hist = batch[i];
+
+      if (i > 0)
+        sql_ << ", ";
+      sql_ << "('";
+      sql_ << hist->timestamp() << "', ";
+      sql_ << hist->conversation_id() << ", ";
+      sql_ << hist->address() << ", ";
+      sql_ << hist->is_inbound() << ", ";
+      sql_ << hist->type() << ", '";
+      sql_ << db.escape(hist->local_im()) << "', '";
+      sql_ << db.escape(hist->remote_im()) << "', ";
+      sql_ << hist->is_filtered() << ", '";
+      sql_ << db.escape(hist->data()) << "')";
+    }
+
+    if (db.execute(sql_.str()))
+      return true;
+
+    log_warn("unable to log %zu messages: MySQL error %d, SQLState "
+             "%s: %s", batch.size(), db.get_last_errno(),
+             db.get_sqlstate(), db.get_error_msg());
+
+    // client errors (CR_*), i.e. the connection itself, start at 2000;
+    // the pool reconnects it
+    return db.get_last_errno() < 2000;
+  }
+
+  void spool(const std::vector<History*>& batch) {
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (!spool_.append(batch[i])) {
+        log_warn("unable to spool %zu messages, dropped",
+                 batch.size() - i);
+        break;
+      }
+    }
+  }
+
+  void replay(dolphinconn::Connection& db) {
+    if (!spool_.start_replay())
+      return;
+
+    std::vector<History*> items;
+    for (;;) {
+      items.clear();
+      spool_.read_replay(items, batch_size_);
+
+      if (!items.empty() && !write(db, items)) {
+        delete_all(items);
+        spool_.abort_replay();
+        break;
+      }
+
+      delete_all(items);
+
+      if (!spool_.commit_replay())
+        break;
+    }
+  }
+
+  static void delete_all(const std::vector<History*>& items) {
+    for (size_t i = 0; i < items.size(); ++i)
+      delete items[i];
+  }
+
   HistoryQueue& queue_;
+  HistorySpool& spool_;
+  std::ostringstream sql_;
+  size_t batch_size_;
+  int batch_wait_;
 };
 
 #endif // HISTORY_HISTORY_CONSUMER_H_
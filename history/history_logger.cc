@@ -10,14 +10,31 @@
 
 #include "history/history.h"
 #include "history/history_consumer.h"
+#include "config.h"
 #include "utils.h"
 #include "log.h"
 
+namespace {
+
+size_t queue_capacity() {
+  int size = Config::instance().getint("history_queue_size");
+  return size > 0 ? size : 10000;
+}
+
+}  // namespace
+
 HistoryLogger* HistoryLogger::instance_ = NULL;
 
 HistoryLogger::HistoryLogger()
-    : consumer_(NULL) {
-  consumer_ = new HistoryConsumer(queue_);
+    : queue_(queue_capacity()),
+      consumer_(NULL) {
+  std::string path = Config::instance()["history_spool"];
+  if (path.empty())
+    path = "/var/spool/wlmproxy/history.spool";
+  // as much again waits in memory for the spool when the queue is full
+  spool_.open(path, queue_capacity());
+
+  consumer_ = new HistoryConsumer(queue_, spool_);
   consumer_->set_joinable(true);
   consumer_->start();
 }
@@ -52,5 +69,8 @@ void HistoryLogger::log(History* history) {
            history->type_string(),
            history->is_filtered() ? "(filtered)" : "(unfiltered)");
 
-  queue_.push(history);
+  // Full, MySQL can't keep up: the consumer puts it on disk rather than
+  // this loop
+  if (!queue_.try_push(history) && !spool_.defer(history))
+    log_warn("history queue full, message dropped");
 }
@@ -10,7 +10,8 @@
 
 #include <boost/noncopyable.hpp>
 
-#include "concurrent_queue.h"
+#include "mpsc_ring.h"
+#include "history/history_spool.h"
 
 class History;
 class HistoryConsumer;
@@ -30,7 +31,9 @@ class HistoryLogger : private boost::noncopyable {
 
   static HistoryLogger* instance_;
 
-  ConcurrentQueue<History*> queue_;
+  MpscRing<History*> queue_;
+
+  HistorySpool spool_;
 
   HistoryConsumer* consumer_;
 };
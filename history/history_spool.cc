@@ -0,0 +1,305 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "history/history_spool.h"
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "history/history.h"
+#include "log.h"
+
+namespace {
+
+// A record is a header line followed by the three strings it gives the
+// length of, and a newline.
+bool write_record(FILE* fp, History* h) {
+  int rv = fprintf(fp, "%ld %u %u %d %d %d %zu %zu %zu\n",
+                   static_cast<long>(h->raw_timestamp()), h->conversation_id(),
+                   h->address(), h->is_inbound(), h->type(),
+                   h->is_filtered(), h->local_im().size(),
+                   h->remote_im().size(), h->data().size());
+  if (rv < 0)
+    return false;
+
+  fwrite(h->local_im().data(), 1, h->local_im().size(), fp);
+  fwrite(h->remote_im().data(), 1, h->remote_im().size(), fp);
+  fwrite(h->data().data(), 1, h->data().size(), fp);
+  fputc('\n', fp);
+
+  return fflush(fp) == 0 && !ferror(fp);
+}
+
+// far above any field, so that a corrupt length isn't allocated
+const size_t kMaxFieldSize = 1 << 20;
+
+bool read_string(FILE* fp, size_t len, std::string& s) {
+  s.resize(len);
+  return len == 0 || fread(&s[0], 1, len, fp) == len;
+}
+
+// Returns NULL at the end of the file or on a bad record.
+History* read_record(FILE* fp) {
+  long t;
+  unsigned conversation_id, address;
+  int inbound, type, filtered;
+  size_t local_len, remote_len, data_len;
+
+  if (fscanf(fp, "%ld %u %u %d %d %d %zu %zu %zu", &t, &conversation_id,
+             &address, &inbound, &type, &filtered, &local_len, &remote_len,
+             &data_len) != 9 || fgetc(fp) != '\n')
+    return NULL;
+
+  if ((inbound != 0 && inbound != 1) || (filtered != 0 && filtered != 1) ||
+      local_len > kMaxFieldSize || remote_len > kMaxFieldSize ||
+      data_len > kMaxFieldSize)
+    return NULL;
+
+  std::string local_im, remote_im, data;
+  if (!read_string(fp, local_len, local_im) ||
+      !read_string(fp, remote_len, remote_im) ||
+      !read_string(fp, data_len, data) ||
+      fgetc(fp) != '\n')
+    return NULL;
+
+  History* h = new History(inbound != 0);
+  h->set_raw_timestamp(static_cast<time_t>(t));
+  h->set_conversation_id(conversation_id);
+  h->set_address(address);
+  h->set_type(static_cast<History::Type>(type));
+  h->set_filtered(filtered != 0);
+  h->set_local_im(local_im);
+  h->set_remote_im(remote_im);
+  h->set_data(data);
+  return h;
+}
+
+}  // namespace
+
+HistorySpool::HistorySpool()
+    : max_deferred_(0),
+      file_(NULL),
+      replay_(NULL),
+      committed_(0),
+      replay_eof_(false),
+      replay_pending_(false),
+      spooling_(false) {
+}
+
+HistorySpool::~HistorySpool() {
+  write_deferred();
+
+  if (replay_)
+    fclose(replay_);
+  if (file_)
+    fclose(file_);
+}
+
+bool HistorySpool::open(const std::string& path, size_t max_deferred) {
+  max_deferred_ = max_deferred;
+  path_ = path;
+  replay_path_ = path + ".replay";
+
+  file_ = fopen(path_.c_str(), "a");
+  if (file_ == NULL) {
+    log_warn("unable to open history spool %s: %s", path_.c_str(),
+             strerror(errno));
+    return false;
+  }
+
+  // left over by a previous run
+  fseek(file_, 0, SEEK_END);
+  spooling_ = ftell(file_) > 0;
+  replay_pending_ = access(replay_path_.c_str(), F_OK) == 0;
+
+  return true;
+}
+
+bool HistorySpool::defer(History* history) {
+  {
+    MutexLocker lock(mutex_);
+    if (file_ != NULL && deferred_.size() < max_deferred_) {
+      deferred_.push_back(history);
+      return true;
+    }
+  }
+
+  delete history;
+  return false;
+}
+
+void HistorySpool::write_deferred() {
+  std::vector<History*> items;
+  {
+    MutexLocker lock(mutex_);
+    items.swap(deferred_);
+  }
+
+  bool ok = true;
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (ok && !append(items[i])) {
+      log_warn("unable to spool %zu messages, dropped", items.size() - i);
+      ok = false;
+    }
+    delete items[i];
+  }
+}
+
+bool HistorySpool::append(History* history) {
+  MutexLocker lock(mutex_);
+
+  if (file_ == NULL)
+    return false;
+
+  if (!write_record(file_, history)) {
+    log_warn("unable to write history spool %s: %s", path_.c_str(),
+             strerror(errno));
+    return false;
+  }
+
+  if (!spooling_) {
+    log_warn("spooling history to %s", path_.c_str());
+    spooling_ = true;
+  }
+
+  return true;
+}
+
+bool HistorySpool::pending() {
+  if (replay_pending_)
+    return true;
+
+  MutexLocker lock(mutex_);
+  return spooling_ || !deferred_.empty();
+}
+
+bool HistorySpool::start_replay() {
+  if (!replay_pending_) {
+    MutexLocker lock(mutex_);
+
+    if (!spooling_ || file_ == NULL)
+      return false;
+
+    fclose(file_);
+    if (rename(path_.c_str(), replay_path_.c_str()) == -1) {
+      log_warn("unable to rename %s: %s", path_.c_str(), strerror(errno));
+    } else {
+      replay_pending_ = true;
+      spooling_ = false;
+    }
+
+    file_ = fopen(path_.c_str(), "a");
+    if (file_ == NULL) {
+      log_warn("unable to open history spool %s: %s", path_.c_str(),
+               strerror(errno));
+    }
+
+    if (!replay_pending_)
+      return false;
+  }
+
+  replay_ = fopen(replay_path_.c_str(), "r");
+  if (replay_ == NULL) {
+    log_warn("unable to open %s: %s", replay_path_.c_str(), strerror(errno));
+    replay_pending_ = false;
+    return false;
+  }
+
+  log_info("replaying spooled history from %s", replay_path_.c_str());
+
+  committed_ = 0;
+  replay_eof_ = false;
+  return true;
+}
+
+void HistorySpool::read_replay(std::vector<History*>& items, size_t max) {
+  while (items.size() < max) {
+    const long start = ftell(replay_);
+    History* h = read_record(replay_);
+    if (h == NULL) {
+      if (feof(replay_) || !resync(start)) {
+        replay_eof_ = true;
+        break;
+      }
+      continue;
+    }
+    items.push_back(h);
+  }
+}
+
+bool HistorySpool::resync(long start) {
+  // Records start on a line of their own; try each line after |start|.
+  long pos = start;
+  for (;;) {
+    if (fseek(replay_, pos, SEEK_SET) != 0)
+      break;
+
+    int c;
+    while ((c = fgetc(replay_)) != EOF && c != '\n')
+      ;
+    if (c == EOF)
+      break;
+
+    pos = ftell(replay_);
+    History* h = read_record(replay_);
+    if (h != NULL) {
+      delete h;
+      fseek(replay_, pos, SEEK_SET);
+      log_warn("bad record in %s at offset %ld, skipped %ld bytes",
+               replay_path_.c_str(), start, pos - start);
+      return true;
+    }
+  }
+
+  log_warn("bad record in %s at offset %ld, nothing readable after it",
+           replay_path_.c_str(), start);
+  return false;
+}
+
+bool HistorySpool::commit_replay() {
+  committed_ = ftell(replay_);
+
+  if (!replay_eof_)
+    return true;
+
+  fclose(replay_);
+  replay_ = NULL;
+  unlink(replay_path_.c_str());
+  replay_pending_ = false;
+
+  log_info("spooled history replayed");
+  return false;
+}
+
+void HistorySpool::abort_replay() {
+  // Keep only what wasn't logged, so the next replay doesn't log twice.
+  std::string tmp_path = replay_path_ + ".tmp";
+  FILE* tmp = fopen(tmp_path.c_str(), "w");
+
+  if (tmp && fseek(replay_, committed_, SEEK_SET) == 0) {
+    char buf[8192];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), replay_)) > 0)
+      fwrite(buf, 1, n, tmp);
+
+    if (fclose(tmp) == 0) {
+      rename(tmp_path.c_str(), replay_path_.c_str());
+    } else {
+      unlink(tmp_path.c_str());
+    }
+  } else {
+    log_warn("unable to write %s: %s", tmp_path.c_str(), strerror(errno));
+    if (tmp) {
+      fclose(tmp);
+      unlink(tmp_path.c_str());
+    }
+  }
+
+  fclose(replay_);
+  replay_ = NULL;
+}
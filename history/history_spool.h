@@ -0,0 +1,83 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef HISTORY_HISTORY_SPOOL_H_
+#define HISTORY_HISTORY_SPOOL_H_
+#pragma once
+
+#include <cstdio>
+
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "thread/mutex.h"
+
+class History;
+
+// Append-only file holding the history that couldn't go to MySQL, either
+// because the queue was full or because the database was down.  What was
+// spooled is moved aside to <path>.replay and read back from there.
+class HistorySpool : private boost::noncopyable {
+ public:
+  HistorySpool();
+  ~HistorySpool();
+
+  // At most |max_deferred| records wait in memory for write_deferred().
+  bool open(const std::string& path, size_t max_deferred);
+
+  bool is_open() const {
+    return file_ != NULL;
+  }
+
+  // Keeps |history| in memory until the consumer spools it, so that the
+  // loops never wait for the disk.  Thread safe; takes |history|, and
+  // returns false if it had to be dropped.
+  bool defer(History* history);
+
+  // Spools what defer() kept.  Consumer thread only.
+  void write_deferred();
+
+  // Consumer thread only; the caller keeps |history|.
+  bool append(History* history);
+
+  // Whether there is something to replay.  Consumer thread only.
+  bool pending();
+
+  // Returns true if there is something to replay, moving the spool aside
+  // unless a replay was left unfinished.  Consumer thread only.
+  bool start_replay();
+
+  // Reads up to |max| records of the replay into |items|.
+  void read_replay(std::vector<History*>& items, size_t max);
+
+  // The records read last were logged.  Returns false at the end of the
+  // replay, which removes the replay file.
+  bool commit_replay();
+
+  // The records read last weren't logged; keeps them for the next replay.
+  void abort_replay();
+
+ private:
+  // Moves the replay past the bad record at |start| to the next one that
+  // reads well; false if there is none.
+  bool resync(long start);
+
+  Mutex mutex_;
+  std::vector<History*> deferred_;
+  size_t max_deferred_;
+  std::string path_;
+  std::string replay_path_;
+  FILE* file_;
+  FILE* replay_;
+  long committed_;
+  bool replay_eof_;
+  bool replay_pending_;
+  bool spooling_;
+};
+
+#endif // HISTORY_HISTORY_SPOOL_H_
@@ -0,0 +1,98 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef LRU_CACHE_H_
+#define LRU_CACHE_H_
+#pragma once
+
+#include <stdint.h>
+
+#include <list>
+
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
+// Hashed cache holding at most |capacity| entries, dropping the least
+// recently used one to make room.  Every entry is tagged with the
+// generation it was computed in; bumping the generation invalidates them
+// all without touching them, stale entries just miss and get replaced.
+// Not thread safe.
+template <typename K, typename V>
+class LruCache : private boost::noncopyable {
+ public:
+  explicit LruCache(size_t capacity)
+      : capacity_(capacity ? capacity : 1),
+        generation_(0),
+        hits_(0),
+        misses_(0),
+        evictions_(0) { }
+
+  bool get(const K& key, V* value) {
+    typename Map::iterator it = map_.find(key);
+    if (it == map_.end() || it->second->generation != generation_) {
+      ++misses_;
+      return false;
+    }
+
+    entries_.splice(entries_.begin(), entries_, it->second);
+    *value = it->second->value;
+    ++hits_;
+    return true;
+  }
+
+  void put(const K& key, const V& value) {
+    typename Map::iterator it = map_.find(key);
+    if (it != map_.end()) {
+      it->second->value = value;
+      it->second->generation = generation_;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return;
+    }
+
+    if (map_.size() >= capacity_) {
+      // a stale entry isn't worth counting as an eviction
+      if (entries_.back().generation == generation_)
+        ++evictions_;
+      map_.erase(entries_.back().key);
+      entries_.pop_back();
+    }
+
+    entries_.push_front(Entry(key, value, generation_));
+    map_[key] = entries_.begin();
+  }
+
+  void invalidate() { ++generation_; }
+
+  size_t size() const { return map_.size(); }
+  size_t capacity() const { return capacity_; }
+
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+  uint64_t evictions() const { return evictions_; }
+
+ private:
+  struct Entry {
+    Entry(const K& k, const V& v, uint64_t g)
+        : key(k), value(v), generation(g) { }
+
+    K key;
+    V value;
+    uint64_t generation;
+  };
+
+  typedef std::list<Entry> List;
+  typedef boost::unordered_map<K, typename List::iterator> Map;
+
+  List entries_;
+  Map map_;
+  size_t capacity_;
+  uint64_t generation_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+};
+
+#endif  // LRU_CACHE_H_
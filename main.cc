@@ -18,17 +18,15 @@
 #include <pwd.h>
 #include <grp.h>
 
-#include <set>
-
 #include <openssl/crypto.h>
 #include <libxml/parser.h>
 #include <event.h>
 
 #include "connection.h"
-#include "server.h"
+#include "connection_pool.h"
+#include "reloader.h"
+#include "worker.h"
 #include "msn/msn.h"
-#include "acl.h"
-#include "word_filter.h"
 #include "history/history_logger.h"
 #include "config.h"
 #include "log.h"
@@ -38,10 +36,6 @@ static void droppriv(const char* user);
 static bool check_pid(const char* pid_file);
 static void write_pid(const char* pid_file);
 static void signal_cb(int sig, short event, void* arg);
-static void cleanup(void);
-
-// XXX: This is ugly.
-extern std::set<Connection*> connections;
 
 int verbose = 0;
 
@@ -102,26 +96,11 @@ static void signal_cb(int sig, short event, void* arg) {
   case SIGINT:
   case SIGHUP:
     log_info("ohhh nooooo mr. bill!");
-    cleanup();
     event_loopexit(NULL);
     break;
   }
 }
 
-static void cleanup(void) {
-  DLOG(2, "%s: called", __func__);
-
-  std::set<Connection*>::iterator c, nxt;
-
-  for (c = connections.begin(); c != connections.end(); c = nxt) {
-    nxt = c;
-    ++nxt;
-    delete *c;
-  }
-
-  connections.clear();
-}
-
 static void usage(const char* progname) {
   fprintf(stderr,
           "usage: %s [-c configfile] [-p port] [-l ipaddr] [-u user] "
@@ -222,9 +201,9 @@ int main(int argc, char** argv) {
   if (!Config::instance().read(config_file))
     errx(1, "config file '%s' not found", config_file);
 
+  ConnectionPool::instance();
+
   msn::msn_init();
-  acl_init();
-  word_filter_init();
 
   HistoryLogger* logger = HistoryLogger::instance();
 
@@ -240,19 +219,30 @@ int main(int argc, char** argv) {
   signal_add(&ev_sigint, NULL);
   signal_add(&ev_sigterm, NULL);
 
-  Server* server = new Server(listen_ip, listen_port);
+  workers_init(base, listen_ip, listen_port);
 
   log_info("starting up on %s:%hu", listen_ip, listen_port);
 
   event_dispatch();
 
-  delete server;
+  // No more database replies, the loops are going away
+  msn::msn_stop();
+
+  // Stop the workers, their listeners and every connection
+  workers_shutdown();
+
+  // Write what the connections left behind
+  msn::msn_shutdown();
+
+  // No more reloads, their timers are gone with the loop
+  Reloader::destroy();
 
   // Cleanup
   event_base_free(base);
 
   // Shutdown
   logger->destroy();
+  ConnectionPool::destroy();
   Config::destroy();
 
   // Make valgrind happy
@@ -0,0 +1,210 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef MPSC_RING_H_
+#define MPSC_RING_H_
+#pragma once
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+// Bounded lock-free queue for many producers and a single consumer, with
+// the interface of ConcurrentQueue.  Each slot carries a sequence number
+// telling whether it is free for the producer that claimed its position or
+// filled for the consumer.  The consumer sleeps on a futex, which producers
+// only wake when it is actually asleep.
+template <typename T>
+class MpscRing : private boost::noncopyable {
+ public:
+  // |capacity| is rounded up to a power of two.
+  explicit MpscRing(size_t capacity)
+      : head_(0),
+        tail_(0),
+        waiting_(0) {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+
+    mask_ = size - 1;
+    slots_ = new Slot[size];
+    for (size_t i = 0; i < size; ++i)
+      slots_[i].seq = i;
+  }
+
+  ~MpscRing() {
+    delete[] slots_;
+  }
+
+  // Like try_push(), but waits for room.
+  void push(const T& t) {
+    while (!try_push(t))
+      sched_yield();
+  }
+
+  // Returns false if the ring is full.
+  bool try_push(const T& t) {
+    Slot* slot;
+    size_t pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+
+    for (;;) {
+      slot = &slots_[pos & mask_];
+      size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+      if (diff == 0) {
+        if (__atomic_compare_exchange_n(&tail_, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+      }
+    }
+
+    slot->value = t;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // pairs with the fence in wait_for_push()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiting_, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&waiting_, 0, __ATOMIC_RELAXED))
+      futex(FUTEX_WAKE_PRIVATE, 1, NULL);
+
+    return true;
+  }
+
+  T pop() {
+    T t;
+    while (!try_pop(t))
+      wait_for_push(NULL);
+    return t;
+  }
+
+  // Waits for an item, then up to |wait_ms| milliseconds for |max| items
+  // to be there, and moves what it got into |items|.  A T() (the stop
+  // marker) ends the wait early.  Unless |first_wait_ms| is negative, the
+  // wait for the first item gives up after that long, with |items| empty.
+  void pop_batch(std::vector<T>& items, size_t max, int wait_ms,
+                 int first_wait_ms = -1) {
+    struct timespec deadline, timeout;
+    T t;
+
+    if (first_wait_ms < 0) {
+      t = pop();
+    } else {
+      deadline_in(first_wait_ms, &deadline);
+      while (!try_pop(t)) {
+        if (!time_left(deadline, &timeout))
+          return;
+        wait_for_push(&timeout);
+      }
+    }
+
+    items.push_back(t);
+    if (t == T())
+      return;
+
+    deadline_in(wait_ms, &deadline);
+
+    while (items.size() < max) {
+      if (try_pop(t)) {
+        items.push_back(t);
+        if (t == T())
+          break;
+        continue;
+      }
+
+      if (!time_left(deadline, &timeout))
+        break;
+
+      wait_for_push(&timeout);
+    }
+  }
+
+ private:
+  struct Slot {
+    size_t seq;
+    T value;
+  };
+
+  static void deadline_in(int ms, struct timespec* deadline) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+  }
+
+  // The time until |deadline|; false if it passed.
+  static bool time_left(const struct timespec& deadline,
+                        struct timespec* timeout) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout->tv_sec = deadline.tv_sec - now.tv_sec;
+    timeout->tv_nsec = deadline.tv_nsec - now.tv_nsec;
+    while (timeout->tv_nsec < 0) {
+      timeout->tv_sec--;
+      timeout->tv_nsec += 1000000000L;
+    }
+    while (timeout->tv_nsec >= 1000000000L) {
+      timeout->tv_sec++;
+      timeout->tv_nsec -= 1000000000L;
+    }
+    return timeout->tv_sec >= 0;
+  }
+
+  bool try_pop(T& t) {
+    Slot* slot = &slots_[head_ & mask_];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head_ + 1)
+      return false;
+
+    t = slot->value;
+    __atomic_store_n(&slot->seq, head_ + mask_ + 1, __ATOMIC_RELEASE);
+    ++head_;
+    return true;
+  }
+
+  bool empty() const {
+    const Slot* slot = &slots_[head_ & mask_];
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head_ + 1;
+  }
+
+  // Sleeps until a producer pushes something or |timeout| passes.
+  void wait_for_push(const struct timespec* timeout) {
+    __atomic_store_n(&waiting_, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (empty())
+      futex(FUTEX_WAIT_PRIVATE, 1, timeout);
+
+    __atomic_store_n(&waiting_, 0, __ATOMIC_RELAXED);
+  }
+
+  long futex(int op, int val, const struct timespec* timeout) {
+    return syscall(SYS_futex, &waiting_, op, val, timeout, NULL, 0);
+  }
+
+  // consumer side
+  Slot* slots_;
+  size_t mask_;
+  size_t head_;
+  char pad1_[64];
+
+  // producer side
+  size_t tail_;
+  char pad2_[64];
+
+  int waiting_;
+};
+
+#endif  // MPSC_RING_H_
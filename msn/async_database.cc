@@ -0,0 +1,441 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "msn/async_database.h"
+
+#include <ctime>
+
+#include <boost/functional/hash.hpp>
+
+#include "msn/msn_database.h"
+#include "msn/policy.h"
+#include "connection_pool.h"
+#include "concurrent_queue.h"
+#include "thread/thread.h"
+#include "worker.h"
+#include "config.h"
+#include "log.h"
+
+using std::string;
+
+namespace msn {
+
+class DatabaseThread : public Thread {
+ public:
+  explicit DatabaseThread(AsyncDatabase* owner) : owner_(owner) {}
+
+  void push(DatabaseJob* job) {
+    queue_.push(job);
+  }
+
+  void run() {
+    for (;;) {
+      DatabaseJob* job = queue_.pop();
+
+      bool quit_loop = job == NULL;
+      if (quit_loop)
+        break;
+
+      {
+        // the connection goes back to the pool between jobs
+        ConnectionLease conn;
+        MsnDatabase db(*conn);
+        job->execute(db);
+      }
+      owner_->done(job);
+    }
+  }
+
+  void stop() {
+    queue_.push(NULL);
+  }
+
+ private:
+  AsyncDatabase* owner_;
+  ConcurrentQueue<DatabaseJob*> queue_;
+};
+
+namespace {
+
+class UpdateJob : public DatabaseJob {
+ public:
+  enum Type {
+    ADD_USER,
+    SET_LOGIN_TIME,
+    USER_LOGOFF,
+    ADD_BUDDY,
+    DELETE_CHAT
+  };
+
+  UpdateJob(Type type, const string& user, const string& who = "")
+      : DatabaseJob(NULL),
+        type_(type),
+        user_(user),
+        who_(who),
+        chat_id_(0) {}
+
+  UpdateJob(const string& user, uint64_t chat_id)
+      : DatabaseJob(NULL),
+        type_(DELETE_CHAT),
+        user_(user),
+        chat_id_(chat_id) {}
+
+  void execute(MsnDatabase& db) {
+    switch (type_) {
+    case ADD_USER:
+      db.add_user(user_);
+      break;
+    case SET_LOGIN_TIME:
+      db.set_login_time(user_);
+      break;
+    case USER_LOGOFF:
+      db.user_logoff(user_);
+      break;
+    case ADD_BUDDY:
+      db.add_buddy(user_, who_);
+      break;
+    case DELETE_CHAT:
+      db.delete_chat(chat_id_);
+      break;
+    }
+  }
+
+ private:
+  const Type type_;
+  const string user_;
+  const string who_;
+  const uint64_t chat_id_;
+};
+
+// The contacts of one ADL, stored with a few statements instead of one
+// per contact.
+class AddBuddiesJob : public DatabaseJob {
+ public:
+  AddBuddiesJob(const string& user, const std::vector<string>& who)
+      : DatabaseJob(NULL), user_(user), who_(who) {}
+
+  void execute(MsnDatabase& db) {
+    if (!db.add_buddies(user_, who_))
+      log_warn("unable to store %zu buddies of %s", who_.size(),
+               user_.c_str());
+  }
+
+ private:
+  const string user_;
+  const std::vector<string> who_;
+};
+
+// The presence updates of one user since the last flush.
+class PresenceJob : public DatabaseJob {
+ public:
+  PresenceJob(const string& user, const UserPresence& presence)
+      : DatabaseJob(NULL), user_(user), presence_(presence) {}
+
+  void execute(MsnDatabase& db) {
+    db.update_presence(user_, presence_);
+  }
+
+ private:
+  const string user_;
+  const UserPresence presence_;
+};
+
+// The rows of conversations whose ids came from a reserved block.
+class AddChatsJob : public DatabaseJob {
+ public:
+  explicit AddChatsJob(std::vector<NewChat>& chats) : DatabaseJob(NULL) {
+    chats_.swap(chats);
+  }
+
+  void execute(MsnDatabase& db) {
+    db.add_chats(chats_);
+  }
+
+ private:
+  std::vector<NewChat> chats_;
+};
+
+}  // namespace
+
+// Refills the conversation ids ahead of need.
+class ReserveChatIdsJob : public DatabaseJob {
+ public:
+  explicit ReserveChatIdsJob(AsyncDatabase* owner)
+      : DatabaseJob(NULL), owner_(owner) {}
+
+  void execute(MsnDatabase& db) {
+    owner_->reserve_chat_ids(db);
+  }
+
+ private:
+  AsyncDatabase* owner_;
+};
+
+AsyncDatabase::AsyncDatabase()
+    : stopped_(false) {
+}
+
+AsyncDatabase::~AsyncDatabase() {
+  shutdown();
+}
+
+bool AsyncDatabase::init() {
+  Config& config = Config::instance();
+
+  int count = config.getint("db_threads");
+  if (count <= 0)
+    count = 2;
+
+  int block_size = config.getint("chat_id_block_size");
+  if (block_size > 0)
+    chat_ids_.reset(new ChatIdAllocator(block_size));
+
+  bool ret;
+  {
+    ConnectionLease conn;
+    MsnDatabase database(*conn);
+    ret = conn->connected();
+    if (ret) {
+      database.cleanup();
+      if (chat_ids_)
+        reserve_chat_ids(database);
+    }
+  }
+
+  for (int i = 0; i < count; ++i)
+    threads_.push_back(new DatabaseThread(this));
+
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->set_joinable(true);
+    threads_[i]->start();
+  }
+
+  return ret;
+}
+
+void AsyncDatabase::stop() {
+  MutexLocker lock(mutex_);
+  stopped_ = true;
+}
+
+void AsyncDatabase::shutdown() {
+  stop();
+  flush_presence();
+  flush_chats();
+
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    threads_[i]->stop();
+    threads_[i]->join();
+    delete threads_[i];
+  }
+  threads_.clear();
+}
+
+size_t AsyncDatabase::thread_index(const string& key) const {
+  boost::hash<string> hasher;
+  return hasher(key) % threads_.size();
+}
+
+void AsyncDatabase::submit(const string& key, DatabaseJob* job) {
+  if (threads_.empty()) {
+    delete job;
+    return;
+  }
+
+  threads_[thread_index(key)]->push(job);
+}
+
+void AsyncDatabase::done(DatabaseJob* job) {
+  if (job->origin()) {
+    MutexLocker lock(mutex_);
+    if (!stopped_) {
+      job->origin()->post(complete_cb, job);
+      return;
+    }
+  }
+
+  delete job;
+}
+
+// static
+void AsyncDatabase::complete_cb(void* arg) {
+  DatabaseJob* job = static_cast<DatabaseJob*>(arg);
+  job->complete();
+  delete job;
+}
+
+void AsyncDatabase::add_user(const string& user) {
+  submit(user, new UpdateJob(UpdateJob::ADD_USER, user));
+}
+
+void AsyncDatabase::set_login_time(const string& user) {
+  submit(user, new UpdateJob(UpdateJob::SET_LOGIN_TIME, user));
+}
+
+void AsyncDatabase::set_status(const string& user, const string& status) {
+  presence_.set(user, Presence::STATUS, status);
+}
+
+void AsyncDatabase::set_friendly_name(const string& user,
+                                      const string& name) {
+  presence_.set(user, Presence::FRIENDLY_NAME, name);
+}
+
+void AsyncDatabase::set_status_message(const string& user, const char* msg) {
+  presence_.set(user, Presence::STATUS_MESSAGE, msg ? msg : "");
+}
+
+void AsyncDatabase::user_logoff(const string& user) {
+  // what is pending goes first, the logoff overrides the statuses
+  UserPresence presence;
+  if (presence_.take(user, presence))
+    submit(user, new PresenceJob(user, presence));
+
+  submit(user, new UpdateJob(UpdateJob::USER_LOGOFF, user));
+}
+
+void AsyncDatabase::add_buddy(const string& user, const string& who) {
+  submit(user, new UpdateJob(UpdateJob::ADD_BUDDY, user, who));
+}
+
+void AsyncDatabase::add_buddies(const string& user,
+                                const std::vector<string>& who) {
+  submit(user, new AddBuddiesJob(user, who));
+}
+
+void AsyncDatabase::buddy_logoff(const string& user, const string& who) {
+  presence_.set_buddy(user, who, Presence::STATUS, "FLN");
+}
+
+void AsyncDatabase::update_buddy(const string& user, const string& who,
+                                 const string& status, const string& name) {
+  presence_.set_buddy(user, who, Presence::STATUS, status);
+  presence_.set_buddy(user, who, Presence::FRIENDLY_NAME, name);
+}
+
+void AsyncDatabase::update_buddy_status(const string& user,
+                                        const string& who,
+                                        const string& status) {
+  presence_.set_buddy(user, who, Presence::STATUS, status);
+}
+
+void AsyncDatabase::set_buddy_friendly_name(const string& user,
+                                            const string& who,
+                                            const string& name) {
+  presence_.set_buddy(user, who, Presence::FRIENDLY_NAME, name);
+}
+
+void AsyncDatabase::set_buddy_status_message(const string& user,
+                                             const string& who,
+                                             const char* msg) {
+  presence_.set_buddy(user, who, Presence::STATUS_MESSAGE, msg ? msg : "");
+}
+
+void AsyncDatabase::flush_presence() {
+  PresenceBuffer::Users users;
+  presence_.take_all(users);
+
+  for (PresenceBuffer::Users::const_iterator it = users.begin();
+       it != users.end(); ++it)
+    submit(it->first, new PresenceJob(it->first, it->second));
+}
+
+void AsyncDatabase::delete_chat(const string& user, uint64_t chat_id) {
+  MutexLocker lock(chats_mutex_);
+
+  // not written yet, it is written closed
+  NewChatMap::iterator it = new_chats_.find(chat_id);
+  if (it != new_chats_.end()) {
+    it->second.closed = true;
+    return;
+  }
+
+  submit(user, new UpdateJob(user, chat_id));
+}
+
+bool AsyncDatabase::new_chat(const string& user, uint32_t& chat_id) {
+  if (!chat_ids_)
+    return false;
+
+  // The row of a user missing from users would never be written; those
+  // who registered since the last policy refresh go to create_chat().
+  if (!policy_snapshot()->has_user(user))
+    return false;
+
+  bool refill;
+  const bool ok = chat_ids_->take(chat_id, refill);
+  if (refill)
+    submit(user, new ReserveChatIdsJob(this));
+  if (!ok)
+    return false;
+
+  MutexLocker lock(chats_mutex_);
+  new_chats_[chat_id] = NewChat(chat_id, user, time(NULL));
+  return true;
+}
+
+uint64_t AsyncDatabase::create_chat(MsnDatabase& database,
+                                    const string& user) {
+  if (!chat_ids_)
+    return database.get_chat_id(user);
+
+  if (!database.user_exists(user))
+    return 0;
+
+  // The blocks ran out on the loop; take one here if the refill didn't
+  // arrive meanwhile.
+  uint32_t chat_id;
+  bool refill;
+  if (!chat_ids_->take(chat_id, refill)) {
+    const uint32_t count = chat_ids_->block_size();
+    if (!database.reserve_chat_ids(count, chat_id)) {
+      if (refill)
+        chat_ids_->refill_failed();
+      return 0;
+    }
+    chat_ids_->add(chat_id + 1, count - 1);
+  } else if (refill) {
+    submit(user, new ReserveChatIdsJob(this));
+  }
+
+  // somebody is waiting for it, so the row isn't held back
+  std::vector<NewChat> chats(1, NewChat(chat_id, user, time(NULL)));
+  if (!database.add_chats(chats))
+    return 0;
+  return chat_id;
+}
+
+void AsyncDatabase::reserve_chat_ids(MsnDatabase& database) {
+  uint32_t first;
+  if (database.reserve_chat_ids(chat_ids_->block_size(), first)) {
+    chat_ids_->add(first, chat_ids_->block_size());
+  } else {
+    log_warn("unable to reserve conversation ids");
+    chat_ids_->refill_failed();
+  }
+}
+
+void AsyncDatabase::flush_chats() {
+  MutexLocker lock(chats_mutex_);
+
+  if (new_chats_.empty() || threads_.empty())
+    return;
+
+  // One job per thread, the one a later delete_chat() of the same user
+  // goes to.
+  std::vector<std::vector<NewChat> > chats(threads_.size());
+  for (NewChatMap::const_iterator it = new_chats_.begin();
+       it != new_chats_.end(); ++it)
+    chats[thread_index(it->second.user)].push_back(it->second);
+  new_chats_.clear();
+
+  for (size_t i = 0; i < chats.size(); ++i) {
+    if (!chats[i].empty())
+      threads_[i]->push(new AddChatsJob(chats[i]));
+  }
+}
+
+}  // namespace msn
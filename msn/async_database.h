@@ -0,0 +1,141 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef MSN_ASYNC_DATABASE_H_
+#define MSN_ASYNC_DATABASE_H_
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "msn/chat_id_allocator.h"
+#include "msn/presence_buffer.h"
+#include "thread/mutex.h"
+
+class Worker;
+
+namespace msn {
+
+class MsnDatabase;
+class DatabaseThread;
+
+// A unit of work for the database threads.
+class DatabaseJob {
+ public:
+  // |origin| is the worker to report back to, if any.
+  explicit DatabaseJob(Worker* origin) : origin_(origin) {}
+  virtual ~DatabaseJob() {}
+
+  // Runs on a database thread.
+  virtual void execute(MsnDatabase& db) = 0;
+
+  // Runs on the origin's loop once execute() returned.
+  virtual void complete() {}
+
+  Worker* origin() const { return origin_; }
+
+ private:
+  Worker* origin_;
+};
+
+// Runs the queries on a pool of threads, on connections of the pool, so
+// the event loops never wait for MySQL.  Jobs are routed by user: all the
+// work for one user runs in order on the same thread.
+class AsyncDatabase : private boost::noncopyable {
+ public:
+  AsyncDatabase();
+  ~AsyncDatabase();
+
+  bool init();
+
+  // Stops reporting back to the loops; called before they go away.
+  void stop();
+
+  // Runs the queued jobs and stops the threads.
+  void shutdown();
+
+  void submit(const std::string& key, DatabaseJob* job);
+
+  // Fire-and-forget updates.  The presence ones (statuses, friendly names
+  // and personal messages) are held back until flush_presence(), so that
+  // only the latest of each is written.
+  void add_user(const std::string& user);
+  void set_login_time(const std::string& user);
+  void set_status(const std::string& user, const std::string& status);
+  void set_friendly_name(const std::string& user, const std::string& name);
+  void set_status_message(const std::string& user, const char* msg);
+  void user_logoff(const std::string& user);
+  void add_buddy(const std::string& user, const std::string& who);
+  void add_buddies(const std::string& user,
+                   const std::vector<std::string>& who);
+  void buddy_logoff(const std::string& user, const std::string& who);
+  void update_buddy(const std::string& user, const std::string& who,
+                    const std::string& status, const std::string& name);
+  void update_buddy_status(const std::string& user, const std::string& who,
+                           const std::string& status);
+  void set_buddy_friendly_name(const std::string& user,
+                               const std::string& who,
+                               const std::string& name);
+  void set_buddy_status_message(const std::string& user,
+                                const std::string& who,
+                                const char* msg);
+  void delete_chat(const std::string& user, uint64_t chat_id);
+
+  // With chat_id_block_size set, hands out a conversation id from the
+  // reserved blocks and holds its row back until flush_chats().  False if
+  // the blocks are off or ran out, or |user| isn't in the policy snapshot;
+  // the id then comes from create_chat().
+  bool new_chat(const std::string& user, uint32_t& chat_id);
+
+  // Creates a conversation on a database thread and returns its id, 0 on
+  // error or if |user| has no row.
+  uint64_t create_chat(MsnDatabase& database, const std::string& user);
+
+  // Writes the presence updates held back so far; called on a timer.
+  void flush_presence();
+
+  // Writes the rows of the conversations new_chat() handed out.
+  void flush_chats();
+
+ private:
+  friend class DatabaseThread;
+  friend class ReserveChatIdsJob;
+
+  typedef boost::unordered_map<uint32_t, NewChat> NewChatMap;
+
+  size_t thread_index(const std::string& key) const;
+
+  void done(DatabaseJob* job);
+
+  // Reserves a block for |chat_ids_|.
+  void reserve_chat_ids(MsnDatabase& database);
+
+  static void complete_cb(void* arg);
+
+  std::vector<DatabaseThread*> threads_;
+
+  PresenceBuffer presence_;
+
+  boost::scoped_ptr<ChatIdAllocator> chat_ids_;
+  // held while the rows are handed to the threads, so that a delete_chat()
+  // either closes a pending row or runs after it was written
+  Mutex chats_mutex_;
+  NewChatMap new_chats_;
+
+  // held while a completion is handed to a loop
+  Mutex mutex_;
+  bool stopped_;
+};
+
+} // namespace msn
+
+#endif // MSN_ASYNC_DATABASE_H_
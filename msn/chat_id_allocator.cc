@@ -0,0 +1,52 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "msn/chat_id_allocator.h"
+
+#include "log.h"
+
+namespace msn {
+
+bool ChatIdAllocator::take(uint32_t& id, bool& refill) {
+  MutexLocker lock(mutex_);
+
+  refill = false;
+  if (!refilling_ && available_ <= block_size_ / 4) {
+    refilling_ = true;
+    refill = true;
+  }
+
+  if (ranges_.empty())
+    return false;
+
+  Range& range = ranges_.front();
+  id = range.first++;
+  --available_;
+  if (range.first == range.second)
+    ranges_.pop_front();
+
+  return true;
+}
+
+void ChatIdAllocator::add(uint32_t first, uint32_t count) {
+  MutexLocker lock(mutex_);
+
+  if (count > 0) {
+    ranges_.push_back(Range(first, first + count));
+    available_ += count;
+  }
+  refilling_ = false;
+
+  DLOG(1, "reserved conversation ids %u-%u, %u available", first,
+       first + count - 1, available_);
+}
+
+void ChatIdAllocator::refill_failed() {
+  MutexLocker lock(mutex_);
+  refilling_ = false;
+}
+
+}  // namespace msn
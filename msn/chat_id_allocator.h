@@ -0,0 +1,74 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef MSN_CHAT_ID_ALLOCATOR_H_
+#define MSN_CHAT_ID_ALLOCATOR_H_
+#pragma once
+
+#include <stdint.h>
+#include <ctime>
+
+#include <deque>
+#include <string>
+#include <utility>
+
+#include <boost/noncopyable.hpp>
+
+#include "thread/mutex.h"
+
+namespace msn {
+
+// A conversation whose id came from a reserved block and whose row isn't
+// written yet.
+struct NewChat {
+  NewChat() : id(0), timestamp(0), closed(false) {}
+  NewChat(uint32_t i, const std::string& u, time_t t)
+      : id(i), user(u), timestamp(t), closed(false) {}
+
+  uint32_t id;
+  std::string user;
+  time_t timestamp;
+  // ended before it was written
+  bool closed;
+};
+
+// Conversation ids reserved from the database in blocks and handed out
+// without a round trip.  A new block is asked for once a quarter of the
+// current one is left, so the loops rarely find it empty.
+class ChatIdAllocator : private boost::noncopyable {
+ public:
+  explicit ChatIdAllocator(uint32_t block_size)
+      : block_size_(block_size),
+        available_(0),
+        refilling_(false) {}
+
+  uint32_t block_size() const { return block_size_; }
+
+  // Takes the next id; false if there is none left.  |refill| tells the
+  // caller to reserve another block, which only one caller at a time is
+  // told.
+  bool take(uint32_t& id, bool& refill);
+
+  // Adds the reserved ids [first, first + count) and ends the refill.
+  void add(uint32_t first, uint32_t count);
+
+  // The reservation failed, the next take() may try again.
+  void refill_failed();
+
+ private:
+  typedef std::pair<uint32_t, uint32_t> Range;
+
+  const uint32_t block_size_;
+
+  Mutex mutex_;
+  std::deque<Range> ranges_;
+  uint32_t available_;
+  bool refilling_;
+};
+
+} // namespace msn
+
+#endif // MSN_CHAT_ID_ALLOCATOR_H_
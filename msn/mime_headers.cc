@@ -0,0 +1,71 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "msn/mime_headers.h"
+
+#include <strings.h>
+
+#include "log.h"
+
+namespace msn {
+
+MimeHeaders::Value MimeHeaders::Value::before_params() const {
+  const char* semicolon = static_cast<const char*>(memchr(data, ';', size));
+  if (semicolon == NULL)
+    return *this;
+
+  size_t len = semicolon - data;
+  while (len > 0 && (data[len - 1] == ' ' || data[len - 1] == '\t'))
+    --len;
+  return Value(data, len);
+}
+
+void MimeHeaders::parse(const char* begin, const char* end) {
+  count_ = 0;
+
+  const char* line = begin;
+  while (line < end) {
+    const char* eol = line;
+    while (eol < end && *eol != '\r' && *eol != '\n')
+      ++eol;
+
+    const char* colon = static_cast<const char*>(memchr(line, ':',
+                                                        eol - line));
+    if (colon != NULL) {
+      if (count_ == kMaxHeaders) {
+        DLOG(1, "too many headers, ignoring the rest");
+        return;
+      }
+
+      const char* value = colon + 1;
+      while (value < eol && (*value == ' ' || *value == '\t'))
+        ++value;
+
+      Header& header = headers_[count_++];
+      header.name = Value(line, colon - line);
+      header.value = Value(value, eol - value);
+      DLOG(2, "\t%.*s: %.*s", static_cast<int>(header.name.size),
+           header.name.data, static_cast<int>(header.value.size),
+           header.value.data);
+    }
+
+    line = eol + 1;
+  }
+}
+
+MimeHeaders::Value MimeHeaders::get(const char* name) const {
+  size_t len = strlen(name);
+
+  // a repeated header counts with its last value
+  for (size_t i = count_; i-- > 0; ) {
+    const Value& n = headers_[i].name;
+    if (n.size == len && strncasecmp(n.data, name, len) == 0)
+      return headers_[i].value;
+  }
+  return Value();
+}
+
+}  // namespace msn
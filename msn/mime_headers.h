@@ -0,0 +1,74 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef MSN_MIME_HEADERS_H_
+#define MSN_MIME_HEADERS_H_
+#pragma once
+
+#include <cstring>
+
+#include <string>
+
+namespace msn {
+
+// The "Name: value" lines of a MIME header, parsed in one pass without
+// copying: names and values point into the parsed text, which must outlive
+// the MimeHeaders.  Names are looked up ignoring case.
+class MimeHeaders {
+ public:
+  // A piece of the parsed text; empty if the header is missing.
+  struct Value {
+    Value() : data(""), size(0) { }
+    Value(const char* data, size_t size) : data(data), size(size) { }
+
+    bool empty() const { return size == 0; }
+
+    bool operator==(const char* s) const {
+      return strlen(s) == size && memcmp(data, s, size) == 0;
+    }
+    bool operator!=(const char* s) const { return !(*this == s); }
+
+    bool starts_with(const char* s) const {
+      size_t len = strlen(s);
+      return len <= size && memcmp(data, s, len) == 0;
+    }
+
+    // Up to the first ';', as in "text/plain; charset=UTF-8".
+    Value before_params() const;
+
+    std::string str() const { return std::string(data, size); }
+
+    const char* data;
+    size_t size;
+  };
+
+  MimeHeaders() : count_(0) { }
+  MimeHeaders(const char* begin, const char* end) { parse(begin, end); }
+
+  // Replaces the headers with those in [begin, end).
+  void parse(const char* begin, const char* end);
+
+  // The value of the last |name| header.
+  Value get(const char* name) const;
+
+  size_t size() const { return count_; }
+
+ private:
+  // more than any message has; the rest are ignored
+  enum { kMaxHeaders = 32 };
+
+  struct Header {
+    Value name;
+    Value value;
+  };
+
+  Header headers_[kMaxHeaders];
+  size_t count_;
+};
+
+}  // namespace msn
+
+#endif  // MSN_MIME_HEADERS_H_
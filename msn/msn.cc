@@ -11,23 +11,27 @@
 #include <cstring>
 
 #include <algorithm>
-#include <map>
-#include <set>
 #include <string>
 #include <vector>
 
 #include <boost/lexical_cast.hpp>
-#include <libxml/parser.h>
 #include <event.h>
+#include <evutil.h>
 
 #include "connection.h"
 #include "chat_session.h"
+#include "worker.h"
+#include "msn/async_database.h"
 #include "msn/msn_database.h"
+#include "msn/mime_headers.h"
+#include "msn/xml_payload.h"
+#include "msn/policy.h"
 #include "history/history.h"
 #include "history/history_logger.h"
 #include "acl.h"
 #include "word_filter.h"
 #include "tokenizer.h"
+#include "config.h"
 #include "defs.h"
 #include "utils.h"
 #include "log.h"
@@ -38,64 +42,50 @@ extern bool show_payload; // in main.cc
 
 namespace {
 
-typedef std::map<std::string, std::string> string_map;
-
-string_map parse_headers(const std::string& headers) {
-  using std::string;
-
-  string_map map;
-
-  if (!headers.size())
-    return map;
-
-  tokenizer<> tk(headers.begin(), headers.end(), "\r\n");
-  while (tk.has_next()) {
-    std::string token = tk.token();
-    size_t separator = token.find(":");
-    if (separator != string::npos) {
-      string key = token.substr(0, separator);
-      string value;
-      if (separator + 1 < token.size()) {
-        size_t value_index = token.find_first_not_of(" \t", separator + 1);
-        if (value_index != string::npos)
-          value = token.substr(value_index);
-      }
-      map[key] = value;
-      DLOG(2, "\t%s: %s", key.c_str(), value.c_str());
-    }
-  }
-
-  return map;
-}
+using msn::MimeHeaders;
 
 typedef void (*cmd_cb)(Command* cmd);
-typedef void (*msg_cb)(Command* cmd, const std::string& mime,
+typedef void (*msg_cb)(Command* cmd, const MimeHeaders& mime,
                        const std::string& body);
 
-typedef std::map<std::string, cmd_cb> cmd_map;
-typedef std::map<std::string, msg_cb> msg_map;
-
-typedef std::set<std::string> payload_set;
-
-static cmd_map commands;
-static msg_map messages;
+// A known content type; |len| saves the compare for most of them.
+struct MessageType {
+  const char* name;
+  size_t len;
+  msg_cb handler;
+};
 
-static payload_set payload_commands_from_client;
-static payload_set payload_commands_from_server;
+static msn::AsyncDatabase db;
 
-static msn::MsnDatabase db;
+static struct event ev_presence;
+static int presence_flush_interval = 2;
+static struct event ev_chats;
+static int chat_flush_interval = 2;
 
 const char* const circle = ";via=9:";
 
-static void parse_cmd(Command* cmd);
-static bool is_payload(const std::string& cmd, const payload_set& payload_cmds);
+static uint32_t verb_code(const std::string& verb);
+static cmd_cb find_command(const std::string& verb);
+static bool is_payload(const std::string& verb, bool inbound);
+static msg_cb find_message(const MimeHeaders::Value& type);
 static void send_command(struct bufferevent* bufev, const std::string& cmd);
 static void send_message(struct bufferevent* bufev,
                          const std::vector<std::string>& args,
                          const std::string& payload);
-static bool check_login(const Command* cmd);
-static bool check_filter(const History* hist, bool encrypted);
-static void do_notifies(Command* cmd);
+
+static void suspend_command(Command* cmd, bool login);
+static bool chat_id_pending(const Command* cmd);
+static void release_command(Command* cmd, bool filtered);
+static void finish_command(Command* cmd, bool filtered);
+static void request_chat_id(Connection* conn, ChatSession* chat);
+static void cache_rules(SessionPointer sess,
+                        const msn::PolicySnapshot& policy);
+static uint32_t session_rules(SessionPointer sess,
+                              const msn::PolicySnapshot& policy);
+static bool check_filter(const msn::PolicySnapshot& policy, uint32_t rules,
+                         const History* hist, bool encrypted);
+static void do_notifies(Command* cmd, const msn::PolicySnapshot& policy,
+                        uint32_t rules);
 static void send_notify(Command* cmd, const std::string& msg);
 static void send_cancel_message(Command* cmd);
 
@@ -120,42 +110,146 @@ static void put_cmd(Command* cmd);
 static void sdg_cmd(Command* cmd);
 static void lst_cmd(Command* cmd);
 
-static void plain_msg(Command* cmd, const std::string& mime,
+static void plain_msg(Command* cmd, const MimeHeaders& mime,
                       const std::string& body);
-static void control_msg(Command* cmd, const std::string& mime,
+static void control_msg(Command* cmd, const MimeHeaders& mime,
                         const std::string& body);
-static void clientcaps_msg(Command* cmd, const std::string& mime,
+static void clientcaps_msg(Command* cmd, const MimeHeaders& mime,
                            const std::string& body);
-static void emoticon_msg(Command* cmd, const std::string& mime,
+static void emoticon_msg(Command* cmd, const MimeHeaders& mime,
                          const std::string& body);
-static void datacast_msg(Command* cmd, const std::string& mime,
+static void datacast_msg(Command* cmd, const MimeHeaders& mime,
                          const std::string& body);
-static void invite_msg(Command* cmd, const std::string& mime,
+static void invite_msg(Command* cmd, const MimeHeaders& mime,
                        const std::string& body);
-static void handwritten_msg(Command* cmd, const std::string& mime,
+static void handwritten_msg(Command* cmd, const MimeHeaders& mime,
                             const std::string& body);
-static void typing_msg(Command* cmd, const std::string& mime,
+static void typing_msg(Command* cmd, const MimeHeaders& mime,
                        const std::string& body);
-static void nudge_msg(Command* cmd, const std::string& mime,
+static void nudge_msg(Command* cmd, const MimeHeaders& mime,
                       const std::string& body);
-static void voiceclip_msg(Command* cmd, const std::string& mime,
+static void voiceclip_msg(Command* cmd, const MimeHeaders& mime,
                           const std::string& body);
-static void wink_msg(Command* cmd, const std::string& mime,
+static void wink_msg(Command* cmd, const MimeHeaders& mime,
                      const std::string& body);
 
 }  // anonymous namespace
 
 namespace {
 
-static void parse_cmd(Command* cmd) {
-  const cmd_map::const_iterator it = commands.find(cmd->args[0]);
-  if (it != commands.end())
-    (*commands[cmd->args[0]])(cmd);
+// The verbs are three characters, so packed into an integer they are
+// switch labels and dispatch needs no string compare.
+#define VERB(a, b, c) \
+  ((static_cast<uint32_t>(a) << 16) | (static_cast<uint32_t>(b) << 8) | (c))
+
+static uint32_t verb_code(const std::string& verb) {
+  if (verb.size() != 3)
+    return 0;
+  return VERB(static_cast<unsigned char>(verb[0]),
+              static_cast<unsigned char>(verb[1]),
+              static_cast<unsigned char>(verb[2]));
 }
 
-static bool is_payload(const std::string& cmd,
-                       const payload_set& payload_cmds) {
-  return payload_cmds.count(cmd) > 0;
+// Returns the handler of |verb|, or NULL if it has none.
+static cmd_cb find_command(const std::string& verb) {
+  switch (verb_code(verb)) {
+    case VERB('A', 'D', 'L'): return &adl_cmd;
+    case VERB('A', 'N', 'S'): return &ans_cmd;
+    case VERB('B', 'Y', 'E'): return &bye_cmd;
+    case VERB('C', 'H', 'G'): return &chg_cmd;
+    case VERB('F', 'L', 'N'): return &fln_cmd;
+    case VERB('I', 'L', 'N'): return &iln_cmd;
+    case VERB('I', 'R', 'O'): return &iro_cmd;
+    case VERB('J', 'O', 'I'): return &joi_cmd;
+    case VERB('L', 'S', 'T'): return &lst_cmd;
+    case VERB('M', 'S', 'G'): return &msg_cmd;
+    case VERB('N', 'F', 'Y'): return &nfy_cmd;
+    case VERB('N', 'L', 'N'): return &nln_cmd;
+    case VERB('P', 'R', 'P'): return &prp_cmd;
+    case VERB('P', 'U', 'T'): return &put_cmd;
+    case VERB('R', 'E', 'A'): return &rea_cmd;
+    case VERB('S', 'D', 'G'): return &sdg_cmd;
+    case VERB('U', 'B', 'X'): return &ubx_cmd;
+    case VERB('U', 'S', 'R'): return &usr_cmd;
+    case VERB('U', 'U', 'X'): return &uux_cmd;
+    case VERB('V', 'E', 'R'): return &ver_cmd;
+    default: return NULL;
+  }
+}
+
+// Whether |verb| carries a payload; |inbound| is from the server.
+static bool is_payload(const std::string& verb, bool inbound) {
+  switch (verb_code(verb)) {
+    case VERB('F', 'Q', 'Y'):
+    case VERB('G', 'C', 'F'):
+    case VERB('M', 'S', 'G'):
+    case VERB('N', 'O', 'T'):
+    case VERB('P', 'U', 'T'):
+    case VERB('S', 'D', 'G'):
+    case VERB('U', 'B', 'N'):
+    case VERB('U', 'B', 'X'):
+    case VERB('U', 'U', 'N'):
+    case VERB('U', 'U', 'X'):
+      return true;
+
+    // from the client only
+    case VERB('A', 'D', 'L'):
+    case VERB('D', 'E', 'L'):
+    case VERB('Q', 'R', 'Y'):
+    case VERB('R', 'M', 'L'):
+    case VERB('S', 'D', 'C'):
+    case VERB('U', 'U', 'M'):
+      return !inbound;
+
+    // from the server only
+    case VERB('8', '0', '1'):
+    case VERB('I', 'P', 'G'):
+    case VERB('N', 'F', 'Y'):
+    case VERB('U', 'B', 'M'):
+      return inbound;
+
+    default:
+      return false;
+  }
+}
+
+#undef VERB
+
+#define MESSAGE_TYPE(name, handler) { name, sizeof(name) - 1, handler }
+
+static const MessageType kMessageTypes[] = {
+  // MSG
+  MESSAGE_TYPE("text/plain", &plain_msg),
+  MESSAGE_TYPE("text/x-msmsgscontrol", &control_msg),
+  MESSAGE_TYPE("text/x-clientcaps", &clientcaps_msg),
+  MESSAGE_TYPE("text/x-clientinfo", &clientcaps_msg),
+  MESSAGE_TYPE("text/x-mms-emoticon", &emoticon_msg),
+  MESSAGE_TYPE("text/x-mms-animemoticon", &emoticon_msg),
+  MESSAGE_TYPE("text/x-msnmsgr-datacast", &datacast_msg),
+  MESSAGE_TYPE("text/x-msmsgsinvite", &invite_msg),
+  MESSAGE_TYPE("image/gif", &handwritten_msg),
+  MESSAGE_TYPE("application/x-ms-ink", &handwritten_msg),
+  // SDG
+  MESSAGE_TYPE("Text", &plain_msg),
+  MESSAGE_TYPE("Control/Typing", &typing_msg),
+  MESSAGE_TYPE("Control/Recording", &typing_msg),
+  MESSAGE_TYPE("Nudge", &nudge_msg),
+  MESSAGE_TYPE("CustomEmoticon", &emoticon_msg),
+  MESSAGE_TYPE("Voice", &voiceclip_msg),
+  MESSAGE_TYPE("Wink", &wink_msg),
+  MESSAGE_TYPE("Invite", &invite_msg),
+};
+
+#undef MESSAGE_TYPE
+
+// Returns the handler of the content type |type|, or NULL if it has none.
+static msg_cb find_message(const MimeHeaders::Value& type) {
+  for (size_t i = 0; i < arraysize(kMessageTypes); ++i) {
+    const MessageType& t = kMessageTypes[i];
+    if (t.len == type.size && memcmp(t.name, type.data, t.len) == 0)
+      return t.handler;
+  }
+  return NULL;
 }
 
 // Send a command
@@ -201,33 +295,282 @@ fail:
     evbuffer_free(databuf);
 }
 
-static bool check_login(const Command* cmd) {
+// Runs the login checks of a suspended command on a database thread, then
+// lets the command go on its connection's loop.  Without a login it only
+// waits for the jobs queued before it, e.g. the conversation id.
+class PolicyJob : public msn::DatabaseJob {
+ public:
+  PolicyJob(Command* cmd, bool login)
+      : msn::DatabaseJob(cmd->conn->worker),
+        conn_(cmd->conn),
+        conn_id_(cmd->conn->id),
+        version_(cmd->conn->session->version),
+        inbound_(cmd->is_inbound()),
+        login_(login),
+        denied_(false) {
+    if (login_ && cmd->args.size() > 4)
+      user_ = cmd->args[4];
+  }
+
+  const std::string& user() const { return user_; }
+
+  void execute(msn::MsnDatabase& database) {
+    if (!login_)
+      return;
+
+    database.add_user(user_);
+
+    if (!database.check_version(version_)) {
+      if (database.can_login(user_)) {
+        database.set_login_time(user_);
+        // registered just now, its rules are in the next snapshot
+        if (!msn::policy_snapshot()->has_user(user_))
+          msn::policy_refresh(database);
+      } else {
+        denied_ = true;
+      }
+    } else {
+      DLOG(1, "Unsupported version '%u'", version_);
+      denied_ = true;
+    }
+  }
+
+  void complete() {
+    // the connection may have gone away meanwhile
+    if (!origin()->has(conn_, conn_id_))
+      return;
+
+    Command* cmd = conn_->cmd[inbound_];
+
+    bool filtered = false;
+
+    if (login_) {
+      filtered = denied_;
+      if (filtered) {
+        // server is unavailable, in response to USR
+        send_command(conn_->client_bufev,
+                     "601 " + lexical_cast<std::string>(cmd->trid));
+      }
+    } else if (cmd->should_ignore()) {
+      cmd->clear_flags(Command::IGNORE);
+      filtered = true;
+    }
+
+    release_command(cmd, filtered);
+
+    cmd->clear_flags(Command::SUSPENDED);
+    conn_->resume(inbound_);
+  }
+
+ private:
+  Connection* conn_;
+  const uint32_t conn_id_;
+  std::string user_;
+  const uint8_t version_;
+  const bool inbound_;
+  const bool login_;
+  bool denied_;
+};
+
+// Creates a conversation and hands its id to the session, or to |chat| on
+// a notification server connection.
+class ChatIdJob : public msn::DatabaseJob {
+ public:
+  ChatIdJob(Connection* conn, ChatSession* chat)
+      : msn::DatabaseJob(conn->worker),
+        conn_(conn),
+        for_chat_(chat != NULL),
+        user_(conn->session->user),
+        conn_id_(conn->id),
+        chat_seq_(chat != NULL ? chat->seq() : 0),
+        chat_id_(0) {
+    if (for_chat_)
+      buddy_ = chat->contact();
+  }
+
+  const std::string& user() const { return user_; }
+
+  void execute(msn::MsnDatabase& database) {
+    chat_id_ = db.create_chat(database, user_);
+  }
+
+  void complete() {
+    if (chat_id_ == 0)
+      log_warn("no conversation id for %s, its messages are logged without "
+               "one", user_.c_str());
+
+    if (origin()->has(conn_, conn_id_)) {
+      SessionPointer sess = conn_->session;
+
+      // Without an id the messages stop waiting for one, instead of each
+      // going to the database again.
+      if (!for_chat_) {
+        if (sess->chat_id == 0) {
+          sess->chat_id = chat_id_;
+          sess->chat_id_failed = chat_id_ == 0;
+          return;
+        }
+      } else {
+        // the chat may have gone away, and another taken its address
+        ChatMap::const_iterator it = sess->chat_sessions.find(buddy_);
+        if (it != sess->chat_sessions.end() &&
+            it->second->seq() == chat_seq_ && it->second->id() == 0) {
+          it->second->set_id(chat_id_);
+          it->second->set_id_failed(chat_id_ == 0);
+          return;
+        }
+      }
+    }
+
+    // nobody is waiting for it anymore
+    if (chat_id_ != 0)
+      db.delete_chat(user_, chat_id_);
+  }
+
+ private:
+  Connection* conn_;
+  const bool for_chat_;
+  const std::string user_;
+  std::string buddy_;
+  const uint32_t conn_id_;
+  const uint32_t chat_seq_;
+  uint64_t chat_id_;
+};
+
+// Holds |cmd| and stops reading in its direction until the database
+// decided what to do with it.
+static void suspend_command(Command* cmd, bool login) {
+  Connection* conn = cmd->conn;
+
+  PolicyJob* job = new PolicyJob(cmd, login);
+
+  cmd->set_flags(Command::SUSPENDED);
+  conn->suspend(cmd->is_inbound());
+
+  db.submit(login ? job->user() : conn->session->user, job);
+}
+
+// Whether the message in |cmd| belongs to a conversation whose id hasn't
+// come back from the database yet.
+static bool chat_id_pending(const Command* cmd) {
   const Connection* conn = cmd->conn;
   const SessionPointer sess = conn->session;
 
-  db.add_user(cmd->args[4]);
+  if (conn->type == Connection::SB)
+    return sess->chat_id == 0 && !sess->chat_id_failed;
 
-  bool denied = false;
-  if (!db.check_version(sess->version)) {
-    if (db.can_login(cmd->args[4]))
-      db.set_login_time(cmd->args[4]);
-    else
-      denied = true;
+  ChatMap::const_iterator it =
+      sess->chat_sessions.find(cmd->hist->remote_im());
+  return it != sess->chat_sessions.end() && it->second->id() == 0 &&
+      !it->second->id_failed();
+}
+
+// Applies the policy to the history of |cmd|, if any, and sends it on.
+static void release_command(Command* cmd, bool filtered) {
+  Connection* conn = cmd->conn;
+  SessionPointer sess = conn->session;
+
+  // TODO: this isn't right.
+  if (cmd->hist != NULL) {
+    const msn::PolicyPointer policy = msn::policy_snapshot();
+    const uint32_t rules = session_rules(sess, *policy);
+
+    filtered = check_filter(*policy, rules, cmd->hist, cmd->is_encrypted());
+
+    if (cmd->is_encrypted()) {
+      cmd->clear_flags(Command::ENCRYPTED);
+      // Do nothing if the message is encrypted.
+      if (!filtered)
+        cmd->hist->set_dont_log();
+    }
+
+    if (!cmd->cookie.empty()) {
+      if (filtered)
+        send_cancel_message(cmd);
+      cmd->cookie.clear();
+    }
+
+    // The conversation id may have arrived after the message was parsed.
+    if (conn->type == Connection::SB) {
+      cmd->hist->set_conversation_id(sess->chat_id);
+    } else {
+      ChatMap::const_iterator it =
+          sess->chat_sessions.find(cmd->hist->remote_im());
+      if (it != sess->chat_sessions.end())
+        cmd->hist->set_conversation_id(it->second->id());
+    }
+
+    cmd->hist->set_filtered(filtered);
+
+    do_notifies(cmd, *policy, rules);
+
+    if (!(rules & SET_BIT_32(1)) || cmd->hist->dont_log()) {
+      delete cmd->hist;
+    } else {
+      HistoryLogger::instance()->log(cmd->hist);
+    }
+
+    cmd->hist = NULL;
+  }
+
+  finish_command(cmd, filtered);
+}
+
+static void finish_command(Command* cmd, bool filtered) {
+  Connection* conn = cmd->conn;
+
+  // Send back "ACK" message to the client if needed.
+  if (cmd->should_send_ack()) {
+    cmd->clear_flags(Command::WAITING_FOR_ACK);
+    if (filtered)
+      send_command(conn->client_bufev, "ACK " + lexical_cast<std::string>(cmd->trid));
+  }
+
+  // Nothing modifies a command; it goes on as it came in or not at all.
+  if (!filtered) {
+    bufferevent_write_buffer(
+        cmd->is_inbound() ? conn->client_bufev : conn->server_bufev,
+        cmd->raw);
   } else {
-    DLOG(1, "Unsupported version '%u'", sess->version);
-    denied = true;
+    evbuffer_drain(cmd->raw, EVBUFFER_LENGTH(cmd->raw));
   }
 
-  if (denied) {
-    // server is unavailable, in response to USR
-    send_command(conn->client_bufev, "601 " + lexical_cast<std::string>(cmd->trid));
+  cmd->payload.clear();
+  cmd->args.clear();
+}
+
+static void request_chat_id(Connection* conn, ChatSession* chat) {
+  uint32_t chat_id;
+  if (db.new_chat(conn->session->user, chat_id)) {
+    if (chat == NULL)
+      conn->session->chat_id = chat_id;
+    else
+      chat->set_id(chat_id);
+    return;
   }
 
-  return denied;
+  ChatIdJob* job = new ChatIdJob(conn, chat);
+  db.submit(job->user(), job);
 }
 
-static bool check_filter(const History* hist, bool encrypted) {
-  if (db.buddy_is_blocked(hist->local_im(), hist->remote_im()))
+// Looks up the rule mask of the session's user once it authenticated.
+static void cache_rules(SessionPointer sess,
+                        const msn::PolicySnapshot& policy) {
+  sess->rules = policy.rules(sess->user);
+  sess->policy_version = policy.version();
+}
+
+// The cached rule mask, looked up again only once the policy changed.
+static uint32_t session_rules(SessionPointer sess,
+                              const msn::PolicySnapshot& policy) {
+  if (sess->policy_version != policy.version())
+    cache_rules(sess, policy);
+  return sess->rules;
+}
+
+static bool check_filter(const msn::PolicySnapshot& policy, uint32_t rules,
+                         const History* hist, bool encrypted) {
+  if (policy.buddy_is_blocked(hist->local_im(), hist->remote_im()))
     return true;
   if (acl_check_deny(hist->local_im(), hist->remote_im()))
     return true;
@@ -281,7 +624,7 @@ static bool check_filter(const History* hist, bool encrypted) {
   }
 
   if (rule_type != 0) {
-    if (db.has_rule(hist->local_im(), rule_type)) {
+    if (rules & SET_BIT_32(rule_type)) {
       if (rule_type == 14)
         return word_filter_check(hist->data());
       return true;
@@ -291,7 +634,8 @@ static bool check_filter(const History* hist, bool encrypted) {
   return false;
 }
 
-static void do_notifies(Command* cmd) {
+static void do_notifies(Command* cmd, const msn::PolicySnapshot& policy,
+                        uint32_t rules) {
   Connection* conn = cmd->conn;
   SessionPointer sess = conn->session;
   History* history = cmd->hist;
@@ -300,18 +644,19 @@ static void do_notifies(Command* cmd) {
 
   if (conn->type == Connection::SB) {
     if (history->type() == History::TYPE_MSG && !sess->warned) {
-      if (db.has_rule(history->local_im(), 2))
-        send_notify(cmd, db.get_setting("default_warning"));
+      if (rules & SET_BIT_32(2))
+        send_notify(cmd, policy.get_setting("default_warning"));
       sess->warned = true;
     }
   } else {
     ChatMap::const_iterator it =
         sess->chat_sessions.find(history->remote_im());
-    ChatSession* chat = it->second;
+    // the chat may have timed out while the command was suspended
+    ChatSession* chat = it != sess->chat_sessions.end() ? it->second : NULL;
 
-    if (history->type() == History::TYPE_MSG && !chat->warned()) {
-      if (db.has_rule(history->local_im(), 2))
-        send_notify(cmd, db.get_setting("default_warning"));
+    if (history->type() == History::TYPE_MSG && chat && !chat->warned()) {
+      if (rules & SET_BIT_32(2))
+        send_notify(cmd, policy.get_setting("default_warning"));
       chat->set_warned(true);
     }
   }
@@ -319,7 +664,7 @@ static void do_notifies(Command* cmd) {
   if (history->is_filtered() &&
       history->type() != History::TYPE_TYPING &&
       history->type() != History::TYPE_CAPS)
-    send_notify(cmd, db.get_setting("filtered_msg"));
+    send_notify(cmd, policy.get_setting("filtered_msg"));
 }
 
 static void send_notify(Command* cmd, const std::string& msg) {
@@ -450,9 +795,10 @@ uint32_t get_or_up(Connection* conn, const std::string& buddy) {
 
   ChatMap::const_iterator it = sess->chat_sessions.find(buddy);
   if (it == sess->chat_sessions.end()) {
-    ret = db.get_chat_id(sess->user);
-    ChatSession* chat = new ChatSession(conn, buddy, ret);
+    ChatSession* chat = new ChatSession(conn, buddy, 0);
     sess->chat_sessions[buddy] = chat;
+    request_chat_id(conn, chat);
+    ret = chat->id();
   } else {
     ChatSession* chat = it->second;
     chat->set_renew(true);
@@ -463,25 +809,23 @@ uint32_t get_or_up(Connection* conn, const std::string& buddy) {
 }
 
 // TODO: Remove this hack.
-void hack(Command* cmd, const std::string& mime) {
+void hack(Command* cmd, const MimeHeaders& mime) {
   Connection* conn = cmd->conn;
 
   if (conn->type == Connection::NS) {
-    string_map header_map = parse_headers(mime);
-
-    const std::string& to = header_map["To"];
-    const std::string& from = header_map["From"];
-    if (to[0] == '9' ||
-        (to.compare(0, 2, "10") == 0) ||
-        (to.compare(0, 2, "13") == 0) ||
-        (from.compare(0, 2, "13") == 0)) {
+    const MimeHeaders::Value to = mime.get("To");
+    const MimeHeaders::Value from = mime.get("From");
+    if (to.starts_with("9") ||
+        to.starts_with("10") ||
+        to.starts_with("13") ||
+        from.starts_with("13")) {
       delete cmd->hist;
       cmd->hist = NULL;
 
       return;
     }
 
-    std::string buddy = cmd->is_inbound() ? from : to;
+    std::string buddy = (cmd->is_inbound() ? from : to).str();
     size_t pos = buddy.find_first_of(':');
     if (pos != std::string::npos)
       buddy.erase(0, pos + 1);
@@ -505,8 +849,9 @@ static void ans_cmd(Command* cmd) {
   if (!cmd->is_inbound()) {
     if (cmd->args.size() >= 3) {
       sess->user = get_account(cmd->args[2]);
+      cache_rules(sess, *msn::policy_snapshot());
       if (sess->chat_id == 0)
-        sess->chat_id = db.get_chat_id(sess->user);
+        request_chat_id(conn, NULL);
       conn->type = Connection::SB;
     }
   }
@@ -544,13 +889,14 @@ static void usr_cmd(Command* cmd) {
     if (cmd->args[2] == "OK") {
       // authenticate OK
       sess->user = get_account(cmd->args[3]);
+      cache_rules(sess, *msn::policy_snapshot());
       if (cmd->args.size() >= 6) {
         if (sess->version <= msn::MSNP9)
           db.set_friendly_name(sess->user, utils::decode_url(cmd->args[4]));
         conn->type = Connection::NS;
       } else if (cmd->args.size() == 5) {
         if (sess->chat_id == 0)
-          sess->chat_id = db.get_chat_id(sess->user);
+          request_chat_id(conn, NULL);
         conn->type = Connection::SB;
       }
     }
@@ -570,26 +916,19 @@ static void msg_cmd(Command* cmd) {
   const std::string& msg = cmd->payload;
 
   size_t index = msg.find("\r\n\r\n");
-  std::string mime = msg.substr(0, index);
-
-  string_map header_map = parse_headers(mime);
-  std::string content_type = header_map["Content-Type"];
-
-  size_t pos = content_type.find("; charset", 0);
-  if (pos != std::string::npos)
-    content_type.erase(pos);
+  const MimeHeaders mime(msg.data(), msg.data() + std::min(index, msg.size()));
 
   std::string body;
-  const int n = msg.size() - mime.size() - 4;
-  if (n > 0)
+  if (index != std::string::npos && index + 4 < msg.size())
     body = msg.substr(index + 4);
 
-  const msg_map::const_iterator it = messages.find(content_type);
-  if (it != messages.end()) {
+  const msg_cb handler = find_message(
+      mime.get("Content-Type").before_params());
+  if (handler) {
     if (!cmd->is_inbound() && (cmd->args[2] == "A" || cmd->args[2] == "D"))
       cmd->set_flags(Command::WAITING_FOR_ACK);
 
-    (*messages[content_type])(cmd, mime, body);
+    (*handler)(cmd, mime, body);
   }
 }
 
@@ -680,76 +1019,18 @@ static void adl_cmd(Command* cmd) {
   SessionPointer sess = cmd->conn->session;
 
   if (cmd->payload.size() > 0) {
-    const std::string& data = cmd->payload;
-    int data_size = static_cast<int>(data.size());
-
-    xmlDocPtr doc = xmlReadMemory(data.c_str(), data_size, "", NULL, 0);
-    if (!doc) {
+    std::vector<std::string> contacts;
+    if (!msn::parse_adl(cmd->payload.data(), cmd->payload.size(), contacts)) {
       log_warn("Document not parsed successfully.");
       return;
     }
 
-    xmlNodePtr adl = xmlDocGetRootElement(doc);
-    if (!adl) {
-      log_warn("empty document");
-      xmlFreeDoc(doc);
-      return;
-    }
-
-    std::string email;
-
-    for (xmlNodePtr domain = adl->children; domain; domain = domain->next) {
-      if (xmlStrEqual(domain->name, reinterpret_cast<const xmlChar*>("d"))) {
-        xmlChar* domain_name = xmlGetProp(
-            domain,
-            reinterpret_cast<const xmlChar*>("n"));
-        if (!domain_name)
-          continue;
-
-        for (xmlNodePtr contact = domain->children;
-             contact;
-             contact = contact->next) {
-          if (xmlStrEqual(contact->name,
-                          reinterpret_cast<const xmlChar*>("c"))) {
-            xmlChar* contact_name = xmlGetProp(
-                contact,
-                reinterpret_cast<const xmlChar*>("n"));
-            if (!contact_name)
-              continue;
-
-            xmlChar* type_val = xmlGetProp(
-                contact,
-                reinterpret_cast<const xmlChar*>("t"));
-            if (!type_val) {
-              xmlFree(contact_name);
-              continue;
-            }
-
-            int type = strtol(reinterpret_cast<char*>(type_val), NULL, 10);
-            if (type == 9 || type == 32) {
-              xmlFree(contact_name);
-              xmlFree(type_val);
-              continue;
-            }
-
-            // TODO: do something better
-            email = reinterpret_cast<char*>(contact_name);
-            email += "@";
-            email += reinterpret_cast<char*>(domain_name);
-
-            xmlFree(contact_name);
-            xmlFree(type_val);
-
-            // NOTE: Wave 4 keeps the user as a contact.
-            if (email != sess->user)
-              db.add_buddy(sess->user, email);
-          }
-        }
-        xmlFree(domain_name);
-      }
-    }
+    // NOTE: Wave 4 keeps the user as a contact.
+    contacts.erase(std::remove(contacts.begin(), contacts.end(), sess->user),
+                   contacts.end());
 
-    xmlFreeDoc(doc);
+    if (!contacts.empty())
+      db.add_buddies(sess->user, contacts);
   }
 }
 
@@ -796,41 +1077,16 @@ static void ubx_cmd(Command* cmd) {
     if (buddy == sess->user)
       return;
 
-    const std::string& data = cmd->payload;
-    int data_size = static_cast<int>(data.size());
-
-    xmlDocPtr doc = xmlReadMemory(data.c_str(), data_size, "", NULL, 0);
-    if (!doc) {
+    std::string psm;
+    bool found;
+    if (!msn::parse_psm(cmd->payload.data(), cmd->payload.size(), psm,
+                        found)) {
       log_warn("Document not parsed successfully.");
       return;
     }
 
-    xmlNodePtr payload_node = xmlDocGetRootElement(doc), psm_node = NULL;
-    if (!payload_node) {
-      log_warn("empty document");
-      xmlFreeDoc(doc);
-      return;
-    }
-
-    for (xmlNodePtr current_node = payload_node->children;
-         current_node;
-         current_node = current_node->next) {
-      if (xmlStrEqual(current_node->name,
-                      reinterpret_cast<const xmlChar*>("PSM"))) {
-        psm_node = current_node;
-        break;
-      }
-    }
-
-    if (psm_node) {
-      xmlChar* psm = xmlNodeListGetString(doc, psm_node->children, 1);
-      db.set_buddy_status_message(sess->user, buddy,
-                                  reinterpret_cast<char*>(psm));
-      if (psm)
-        xmlFree(psm);
-    }
-
-    xmlFreeDoc(doc);
+    if (found)
+      db.set_buddy_status_message(sess->user, buddy, psm.c_str());
   }
 }
 
@@ -838,40 +1094,16 @@ static void uux_cmd(Command* cmd) {
   SessionPointer sess = cmd->conn->session;
 
   if (!cmd->is_inbound()) {
-    const std::string& data = cmd->payload;
-    int data_size = static_cast<int>(data.size());
-
-    xmlDocPtr doc = xmlReadMemory(data.c_str(), data_size, "", NULL, 0);
-    if (!doc) {
+    std::string psm;
+    bool found;
+    if (!msn::parse_psm(cmd->payload.data(), cmd->payload.size(), psm,
+                        found)) {
       log_warn("Document not parsed successfully.");
       return;
     }
 
-    xmlNodePtr payload_node = xmlDocGetRootElement(doc), psm_node = NULL;
-    if (!payload_node) {
-      log_warn("empty document");
-      xmlFreeDoc(doc);
-      return;
-    }
-
-    for (xmlNodePtr current_node = payload_node->children;
-         current_node;
-         current_node = current_node->next) {
-      if (xmlStrEqual(current_node->name,
-                      reinterpret_cast<const xmlChar*>("PSM"))) {
-        psm_node = current_node;
-        break;
-      }
-    }
-
-    if (psm_node) {
-      xmlChar* psm = xmlNodeListGetString(doc, psm_node->children, 1);
-      db.set_status_message(sess->user, reinterpret_cast<char*>(psm));
-      if (psm)
-        xmlFree(psm);
-    }
-
-    xmlFreeDoc(doc);
+    if (found)
+      db.set_status_message(sess->user, psm.c_str());
   }
 }
 
@@ -881,11 +1113,12 @@ static void nfy_cmd(Command* cmd) {
   if (cmd->payload.empty())
     return;
 
+  const char* data = cmd->payload.data();
   size_t routing_end_pos = cmd->payload.find("\r\n\r\n");
-  std::string mime = cmd->payload.substr(0, routing_end_pos);
-  string_map routing_headers = parse_headers(mime);
+  const MimeHeaders routing_headers(
+      data, data + std::min(routing_end_pos, cmd->payload.size()));
 
-  std::string buddy = routing_headers["From"];
+  std::string buddy = routing_headers.get("From").str();
   if (buddy.empty())
     return;
 
@@ -903,80 +1136,31 @@ static void nfy_cmd(Command* cmd) {
 
   size_t content_end_pos = cmd->payload.find("\r\n\r\n",
                                              reliability_end_pos + 4);
-  mime = cmd->payload.substr(
-      reliability_end_pos + 4, content_end_pos - (reliability_end_pos + 4));
-  string_map content_headers = parse_headers(mime);
+  if (reliability_end_pos == std::string::npos ||
+      content_end_pos == std::string::npos)
+    return;
+  const MimeHeaders content_headers(data + reliability_end_pos + 4,
+                                    data + content_end_pos);
 
-  if (content_headers["Content-Type"] != "application/user+xml")
+  if (content_headers.get("Content-Type") != "application/user+xml")
     return;
 
   if (cmd->args[1] == "PUT") {
-    const char* data = cmd->payload.data() + content_end_pos + 4;
-    int data_size =
-        static_cast<int>(cmd->payload.length() - content_end_pos) - 4;
-
-    xmlDocPtr doc = xmlReadMemory(data, data_size, "", NULL, 0);
-    if (!doc) {
+    msn::UserStatus user;
+    if (!msn::parse_user_status(data + content_end_pos + 4,
+                                cmd->payload.size() - content_end_pos - 4,
+                                user)) {
       log_warn("Document not parsed successfully.");
       return;
     }
 
-    xmlNodePtr user_node = xmlDocGetRootElement(doc);
-    if (!user_node) {
-      log_warn("empty document");
-      xmlFreeDoc(doc);
-      return;
-    }
-
-    xmlNodePtr current_node = user_node->children, s_node = NULL;
-    while (current_node) {
-      if (xmlStrEqual(current_node->name,
-                      reinterpret_cast<const xmlChar*>("s"))) {
-        s_node = current_node->children;
-        while (s_node) {
-          if (xmlStrEqual(s_node->name,
-                          reinterpret_cast<const xmlChar*>("Status"))) {
-            xmlChar* status_val =
-                xmlNodeListGetString(doc, s_node->children, 1);
-            if (status_val) {
-              // TODO: avoid copy.
-              const std::string status = reinterpret_cast<char*>(status_val);
-
-              xmlFree(status_val);
-
-              db.update_buddy_status(sess->user, buddy, status);
-            }
-          } else if (xmlStrEqual(s_node->name,
-                                 reinterpret_cast<const xmlChar*>
-                                     ("FriendlyName"))) {
-            xmlChar* display_name_val =
-                xmlNodeListGetString(doc, s_node->children, 1);
-            if (display_name_val) {
-              // TODO: avoid copy.
-              const std::string display_name =
-                  reinterpret_cast<char*>(display_name_val);
-
-              xmlFree(display_name_val);
-
-              db.set_buddy_friendly_name(sess->user, buddy,
-                                         utils::decode_url(display_name));
-            }
-          } else if (xmlStrEqual(s_node->name,
-                                 reinterpret_cast<const xmlChar*>("PSM"))) {
-            xmlChar* psm = xmlNodeListGetString(doc, s_node->children, 1);
-            db.set_buddy_status_message(sess->user, buddy,
-                                        reinterpret_cast<char*>(psm));
-            if (psm)
-              xmlFree(psm);
-          }
-
-          s_node = s_node->next;
-        }
-      }
-      current_node = current_node->next;
-    }
-
-    xmlFreeDoc(doc);
+    if (user.has_status)
+      db.update_buddy_status(sess->user, buddy, user.status);
+    if (user.has_friendly_name)
+      db.set_buddy_friendly_name(sess->user, buddy,
+                                 utils::decode_url(user.friendly_name));
+    if (user.has_psm)
+      db.set_buddy_status_message(sess->user, buddy, user.psm.c_str());
   } else if (cmd->args[1] == "DEL") {
     db.buddy_logoff(sess->user, buddy);
   }
@@ -993,77 +1177,31 @@ static void put_cmd(Command* cmd) {
 
     size_t content_end_pos = cmd->payload.find("\r\n\r\n",
                                                reliability_end_pos + 4);
-    std::string mime = cmd->payload.substr(
-        reliability_end_pos + 4, content_end_pos - (reliability_end_pos + 4));
-    string_map content_headers = parse_headers(mime);
-
-    if (content_headers["Content-Type"] != "application/user+xml")
+    if (reliability_end_pos == std::string::npos ||
+        content_end_pos == std::string::npos)
       return;
 
-    const char* data = cmd->payload.data() + content_end_pos + 4;
-    int data_size =
-        static_cast<int>(cmd->payload.length() - content_end_pos) - 4;
+    const char* data = cmd->payload.data();
+    const MimeHeaders content_headers(data + reliability_end_pos + 4,
+                                      data + content_end_pos);
 
-    xmlDocPtr doc = xmlReadMemory(data, data_size, "", NULL, 0);
-    if (!doc) {
-      log_warn("Document not parsed successfully.");
+    if (content_headers.get("Content-Type") != "application/user+xml")
       return;
-    }
 
-    xmlNodePtr user_node = xmlDocGetRootElement(doc);
-    if (!user_node) {
-      log_warn("empty document");
-      xmlFreeDoc(doc);
+    msn::UserStatus user;
+    if (!msn::parse_user_status(data + content_end_pos + 4,
+                                cmd->payload.size() - content_end_pos - 4,
+                                user)) {
+      log_warn("Document not parsed successfully.");
       return;
     }
 
-    xmlNodePtr current_node = user_node->children, s_node = NULL;
-    while (current_node) {
-      if (xmlStrEqual(current_node->name,
-                      reinterpret_cast<const xmlChar*>("s"))) {
-        s_node = current_node->children;
-        while (s_node) {
-          if (xmlStrEqual(s_node->name,
-                          reinterpret_cast<const xmlChar*>("Status"))) {
-            xmlChar* status_val =
-                xmlNodeListGetString(doc, s_node->children, 1);
-            if (status_val) {
-              // TODO: avoid copy.
-              const std::string status = reinterpret_cast<char*>(status_val);
-
-              xmlFree(status_val);
-
-              db.set_status(sess->user, status);
-            }
-          } else if (xmlStrEqual(s_node->name,
-                                 reinterpret_cast<const xmlChar*>
-                                     ("FriendlyName"))) {
-            xmlChar* display_name_val =
-                xmlNodeListGetString(doc, s_node->children, 1);
-            if (display_name_val) {
-              // TODO: avoid copy.
-              const std::string display_name =
-                  reinterpret_cast<char*>(display_name_val);
-
-              xmlFree(display_name_val);
-
-              db.set_friendly_name(sess->user, utils::decode_url(display_name));
-            }
-          } else if (xmlStrEqual(s_node->name,
-                                 reinterpret_cast<const xmlChar*>("PSM"))) {
-            xmlChar* psm = xmlNodeListGetString(doc, s_node->children, 1);
-            db.set_status_message(sess->user, reinterpret_cast<char*>(psm));
-            if (psm)
-              xmlFree(psm);
-          }
-
-          s_node = s_node->next;
-        }
-      }
-      current_node = current_node->next;
-    }
-
-    xmlFreeDoc(doc);
+    if (user.has_status)
+      db.set_status(sess->user, user.status);
+    if (user.has_friendly_name)
+      db.set_friendly_name(sess->user, utils::decode_url(user.friendly_name));
+    if (user.has_psm)
+      db.set_status_message(sess->user, user.psm.c_str());
   }
 }
 
@@ -1075,23 +1213,23 @@ static void sdg_cmd(Command* cmd) {
   size_t reliability_end_pos = msg.find("\r\n\r\n", routing_end_pos + 4);
 
   size_t content_end_pos = msg.find("\r\n\r\n", reliability_end_pos + 4);
+  if (reliability_end_pos == std::string::npos ||
+      content_end_pos == std::string::npos)
+    return;
 
-  std::string mime = msg.substr(
-      reliability_end_pos + 4, content_end_pos - (reliability_end_pos + 4));
-  string_map content_headers = parse_headers(mime);
-
-  mime = msg.substr(0, routing_end_pos);
+  const MimeHeaders content_headers(msg.data() + reliability_end_pos + 4,
+                                    msg.data() + content_end_pos);
 
-  std::string message_type = content_headers["Message-Type"];
+  const MimeHeaders mime(msg.data(), msg.data() + routing_end_pos);
 
   std::string body;
   const int n = msg.size() - content_end_pos - 4;
   if (n > 0)
     body = msg.substr(content_end_pos + 4);
 
-  const msg_map::const_iterator it = messages.find(message_type);
-  if (it != messages.end())
-    (*messages[message_type])(cmd, mime, body);
+  const msg_cb handler = find_message(content_headers.get("Message-Type"));
+  if (handler)
+    (*handler)(cmd, mime, body);
 }
 
 static void lst_cmd(Command* cmd) {
@@ -1114,7 +1252,7 @@ static void lst_cmd(Command* cmd) {
 
 namespace {
 
-static void plain_msg(Command* cmd, const std::string& mime,
+static void plain_msg(Command* cmd, const MimeHeaders& mime,
                       const std::string& body) {
   static const std::string crypt_header[] = {
       "*** Encrypted :",  // Gaim-Encryption
@@ -1140,34 +1278,33 @@ static void plain_msg(Command* cmd, const std::string& mime,
   hack(cmd, mime);
 }
 
-static void control_msg(Command* cmd, const std::string& mime,
+static void control_msg(Command* cmd, const MimeHeaders& mime,
                         const std::string& body) {
-  string_map header_map = parse_headers(mime);
-
-  if (!header_map["TypingUser"].empty() ||
-      !header_map["RecordingUser"].empty()) {
+  if (!mime.get("TypingUser").empty() ||
+      !mime.get("RecordingUser").empty()) {
     typing_msg(cmd, mime, body);
   }
 }
 
-static void clientcaps_msg(Command* cmd, const std::string& mime,
+static void clientcaps_msg(Command* cmd, const MimeHeaders& mime,
                            const std::string& body) {
   cmd->hist = new History(cmd, History::TYPE_CAPS);
   cmd->hist->set_dont_log();
 }
 
-static void emoticon_msg(Command* cmd, const std::string& mime,
+static void emoticon_msg(Command* cmd, const MimeHeaders& mime,
                          const std::string& body) {
   cmd->hist = new History(cmd, History::TYPE_EMOTICON);
 
   hack(cmd, mime);
 }
 
-static void datacast_msg(Command* cmd, const std::string& mime,
+static void datacast_msg(Command* cmd, const MimeHeaders& mime,
                          const std::string& body) {
-  string_map header_map = parse_headers(body);
+  const MimeHeaders body_headers(body.data(), body.data() + body.size());
 
-  const int id = strtol(header_map["ID"].c_str(), NULL, 10);
+  // the value ends at a line break or the end of |body|
+  const int id = strtol(body_headers.get("ID").data, NULL, 10);
   switch (id) {
     case 1:
       nudge_msg(cmd, mime, body);
@@ -1185,18 +1322,16 @@ static void datacast_msg(Command* cmd, const std::string& mime,
   }
 }
 
-static void invite_msg(Command* cmd, const std::string& mime,
+static void invite_msg(Command* cmd, const MimeHeaders& mime,
                        const std::string& body) {
   // TODO implement this properly.
-  string_map header_map;
+  MimeHeaders body_headers;
   if (body.length())
-    header_map = parse_headers(body);
-  else
-    header_map = parse_headers(mime);
+    body_headers.parse(body.data(), body.data() + body.size());
+  const MimeHeaders& headers = body.length() ? body_headers : mime;
 
-  const std::string& command = header_map["Invitation-Command"];
-  if (command == "INVITE") {
-    const std::string& guid = header_map["Application-GUID"];
+  if (headers.get("Invitation-Command") == "INVITE") {
+    const MimeHeaders::Value guid = headers.get("Application-GUID");
     if (guid.empty())
       return;
 
@@ -1208,24 +1343,24 @@ static void invite_msg(Command* cmd, const std::string& mime,
       cmd->hist = new History(cmd, History::TYPE_WEBCAM);
     } else if (guid == "{5D3E02AB-6190-11d3-BBBB-00C04F795683}") {
       cmd->hist = new History(cmd, History::TYPE_FILE);
-      cmd->hist->set_data(header_map["Application-FileSize"] + " " +
-                          header_map["Application-File"]);
+      cmd->hist->set_data(headers.get("Application-FileSize").str() + " " +
+                          headers.get("Application-File").str());
     } else {
       cmd->hist = new History(cmd, History::TYPE_APPLICATION);
     }
 
-    cmd->cookie = header_map["Invitation-Cookie"];
+    cmd->cookie = headers.get("Invitation-Cookie").str();
 
     hack(cmd, mime);
   }
 }
 
-static void handwritten_msg(Command* cmd, const std::string& mime,
+static void handwritten_msg(Command* cmd, const MimeHeaders& mime,
                             const std::string& body) {
   cmd->hist = new History(cmd, History::TYPE_INK);
 }
 
-static void typing_msg(Command* cmd, const std::string& mime,
+static void typing_msg(Command* cmd, const MimeHeaders& mime,
                        const std::string& body) {
   cmd->hist = new History(cmd, History::TYPE_TYPING);
   cmd->hist->set_dont_log();
@@ -1233,21 +1368,21 @@ static void typing_msg(Command* cmd, const std::string& mime,
   hack(cmd, mime);
 }
 
-static void nudge_msg(Command* cmd, const std::string& mime,
+static void nudge_msg(Command* cmd, const MimeHeaders& mime,
                       const std::string& body) {
   cmd->hist = new History(cmd, History::TYPE_NUDGE);
 
   hack(cmd, mime);
 }
 
-static void voiceclip_msg(Command* cmd, const std::string& mime,
+static void voiceclip_msg(Command* cmd, const MimeHeaders& mime,
                           const std::string& body) {
   cmd->hist = new History(cmd, History::TYPE_VOICECLIP);
 
   hack(cmd, mime);
 }
 
-static void wink_msg(Command* cmd, const std::string& mime,
+static void wink_msg(Command* cmd, const MimeHeaders& mime,
                      const std::string& body) {
   cmd->hist = new History(cmd, History::TYPE_WINK);
 
@@ -1256,91 +1391,65 @@ static void wink_msg(Command* cmd, const std::string& mime,
 
 }  // anonymous namespace
 
+// Writes the presence updates of the last seconds, the latest of each.
+static void flush_presence(int fd, short event, void* arg) {
+  struct timeval tv;
+
+  evutil_timerclear(&tv);
+  tv.tv_sec = presence_flush_interval;
+  event_add(&ev_presence, &tv);
+
+  db.flush_presence();
+}
+
+// Writes the rows of the conversations started since the last time.
+static void flush_chats(int fd, short event, void* arg) {
+  struct timeval tv;
+
+  evutil_timerclear(&tv);
+  tv.tv_sec = chat_flush_interval;
+  event_add(&ev_chats, &tv);
+
+  db.flush_chats();
+}
+
 namespace msn {
 
 void msn_init(void) {
-  if (commands.size() == 0) {
-    commands["CHG"] = &chg_cmd;
-    commands["ADL"] = &adl_cmd;
-    commands["ANS"] = &ans_cmd;
-    commands["IRO"] = &iro_cmd;
-    commands["USR"] = &usr_cmd;
-    commands["VER"] = &ver_cmd;
-    commands["REA"] = &rea_cmd;
-    commands["PRP"] = &prp_cmd;
-    commands["LST"] = &lst_cmd;
-    commands["MSG"] = &msg_cmd;
-    commands["JOI"] = &joi_cmd;
-    commands["BYE"] = &bye_cmd;
-    commands["FLN"] = &fln_cmd;
-    commands["NLN"] = &nln_cmd;
-    commands["ILN"] = &iln_cmd;
-    commands["UBX"] = &ubx_cmd;
-    commands["UUX"] = &uux_cmd;
-    commands["NFY"] = &nfy_cmd;
-    commands["PUT"] = &put_cmd;
-    commands["SDG"] = &sdg_cmd;
-  }
+  struct timeval tv;
 
-  if (messages.size() == 0) {
-    messages["text/plain"] = &plain_msg;
-    messages["text/x-msmsgscontrol"] = &control_msg;
-    messages["text/x-clientcaps"] = &clientcaps_msg;
-    messages["text/x-clientinfo"] = &clientcaps_msg;
-    messages["text/x-mms-emoticon"] = &emoticon_msg;
-    messages["text/x-mms-animemoticon"] = &emoticon_msg;
-    messages["text/x-msnmsgr-datacast"] = &datacast_msg;
-    messages["text/x-msmsgsinvite"] = &invite_msg;
-    messages["image/gif"] = &handwritten_msg;
-    messages["application/x-ms-ink"] = &handwritten_msg;
-    messages["Text"] = &plain_msg;
-    messages["Control/Typing"] = &typing_msg;
-    messages["Control/Recording"] = &typing_msg;
-    messages["Nudge"] = &nudge_msg;
-    messages["CustomEmoticon"] = &emoticon_msg;
-    messages["Voice"] = &voiceclip_msg;
-    messages["Wink"] = &wink_msg;
-    messages["Invite"] = &invite_msg;
-  }
+  db.init();
 
-  if (payload_commands_from_client.size() == 0) {
-    payload_commands_from_client.insert("MSG");
-    payload_commands_from_client.insert("UBX");
-    payload_commands_from_client.insert("UUX");
-    payload_commands_from_client.insert("ADL");
-    payload_commands_from_client.insert("RML");
-    payload_commands_from_client.insert("FQY");
-    payload_commands_from_client.insert("DEL");
-    payload_commands_from_client.insert("PUT");
-    payload_commands_from_client.insert("SDG");
-    payload_commands_from_client.insert("QRY");
-    payload_commands_from_client.insert("GCF");
-    payload_commands_from_client.insert("NOT");
-    payload_commands_from_client.insert("SDC");
-    payload_commands_from_client.insert("UUN");
-    payload_commands_from_client.insert("UBN");
-    payload_commands_from_client.insert("UUM");
-  }
+  int interval = Config::instance().getint("presence_flush_interval");
+  if (interval > 0)
+    presence_flush_interval = interval;
 
-  if (payload_commands_from_server.size() == 0) {
-    payload_commands_from_server.insert("MSG");
-    payload_commands_from_server.insert("UBX");
-    payload_commands_from_server.insert("UUX");
-    payload_commands_from_server.insert("FQY");
-    payload_commands_from_server.insert("PUT");
-    payload_commands_from_server.insert("NFY");
-    payload_commands_from_server.insert("SDG");
-    payload_commands_from_server.insert("GCF");
-    payload_commands_from_server.insert("NOT");
-    payload_commands_from_server.insert("UUN");
-    payload_commands_from_server.insert("UBN");
-    payload_commands_from_server.insert("IPG");
-    payload_commands_from_server.insert("UBM");
-    payload_commands_from_server.insert("801");
-  }
+  evtimer_set(&ev_presence, flush_presence, NULL);
+  evutil_timerclear(&tv);
+  tv.tv_sec = presence_flush_interval;
+  event_add(&ev_presence, &tv);
+
+  interval = Config::instance().getint("chat_flush_interval");
+  if (interval > 0)
+    chat_flush_interval = interval;
+
+  evtimer_set(&ev_chats, flush_chats, NULL);
+  evutil_timerclear(&tv);
+  tv.tv_sec = chat_flush_interval;
+  event_add(&ev_chats, &tv);
+
+  msn::policy_init(&db);
+  acl_init();
+  word_filter_init();
+  chat_session_init();
+}
+
+void msn_stop(void) {
+  db.stop();
+}
 
-  if (db.init())
-    db.cleanup();
+void msn_shutdown(void) {
+  db.shutdown();
 }
 
 void destroy_cb(Connection* conn) {
@@ -1353,14 +1462,15 @@ void destroy_cb(Connection* conn) {
       for (ChatMap::iterator it = sess->chat_sessions.begin();
            it != sess->chat_sessions.end(); ++it) {
         ChatSession* chat = it->second;
-        db.delete_chat(chat->id());
+        if (chat->id() != 0)
+          db.delete_chat(sess->user, chat->id());
         delete chat;
       }
       sess->chat_sessions.clear();
     }
   } else if (conn->type == Connection::SB) {
     if (sess->chat_id != 0)
-      db.delete_chat(sess->chat_id);
+      db.delete_chat(sess->user, sess->chat_id);
   }
 }
 
@@ -1369,90 +1479,111 @@ void drop_chat(Connection* conn, const std::string& buddy) {
 
   ChatMap::iterator it = sess->chat_sessions.find(buddy);
   ChatSession* chat = it->second;
-  db.delete_chat(chat->id());
+  if (chat->id() != 0)
+    db.delete_chat(sess->user, chat->id());
   sess->chat_sessions.erase(it);
 }
 
+// Copies the payload, which is kept in pieces in |cmd->raw| right after
+// the command line, into one string for the handler.
+static void linearize_payload(Command* cmd) {
+  const size_t len = EVBUFFER_LENGTH(cmd->raw) - cmd->line_len;
+  if (len == 0)
+    return;
+
+  struct evbuffer_ptr pos;
+  evbuffer_ptr_set(cmd->raw, &pos, cmd->line_len, EVBUFFER_PTR_SET);
+
+  cmd->payload.resize(len);
+  evbuffer_copyout_from(cmd->raw, &pos, &cmd->payload[0], len);
+}
+
 int parse_packet(bool inbound, struct evbuffer* input, Connection* conn) {
   Command* cmd = conn->cmd[inbound]; // 0 for client to server
 
-  const char* buf = reinterpret_cast<const char*>(EVBUFFER_DATA(input));
-  size_t buf_len = EVBUFFER_LENGTH(input);
+  const size_t buf_len = EVBUFFER_LENGTH(input);
 
   bool done = false;
   if (!cmd->is_chunked()) {
-    char* linebreak = reinterpret_cast<char*>(evbuffer_find(
-        input, reinterpret_cast<const u_char*>("\r\n"), 2));
+    struct evbuffer_ptr crlf = evbuffer_search(input, "\r\n", 2, NULL);
 
-    if (linebreak == NULL) {  // no CRLF found
+    if (crlf.pos == -1) {  // no CRLF found
       DLOG(1, " -- ignoring line without crlf");
       return -1;
     }
 
-    const std::string line(buf, linebreak - buf);
+    // only the line is made contiguous, not what follows it
+    const char* line =
+        reinterpret_cast<const char*>(evbuffer_pullup(input, crlf.pos));
 
-    DLOG(1, "%c: %u: %s", inbound ? 'S' : 'C', conn->id, line.c_str());
+    DLOG(1, "%c: %u: %.*s", inbound ? 'S' : 'C', conn->id,
+         static_cast<int>(crlf.pos), line);
 
-    const size_t line_len = linebreak - buf + 2;
+    const size_t line_len = crlf.pos + 2;
 
-    tokenizer<> t(line, " ");
+    tokenizer<std::string, const char*> t(line, line + crlf.pos, " ");
     while (t.has_next())
       cmd->args.push_back(t.token());
 
+    // the command line as it is, without copying it
+    evbuffer_remove_buffer(input, cmd->raw, line_len);
+    cmd->line_len = line_len;
+
+    // a blank line
+    if (cmd->args.empty()) {
+      evbuffer_drain(cmd->raw, line_len);
+      return 0;
+    }
+
     if (cmd->args.size() > 1) {
       cmd->trid = isdigit(cmd->args[1][0]) ? atoi(cmd->args[1].c_str()) : 0;
     } else {
       cmd->trid = 0;
     }
 
-    bool has_payload = is_payload(cmd->args[0], inbound
-                                  ? payload_commands_from_server
-                                  : payload_commands_from_client);
+    bool has_payload = is_payload(cmd->args[0], inbound);
 
     if (has_payload) {
       if (isdigit(cmd->args[ (cmd->args.size() - 1) ][0]))
         cmd->payload_len = atol(cmd->args[ (cmd->args.size() - 1) ].c_str());
       if (cmd->payload_len > 0) {
-        linebreak += 2;
         if (buf_len - line_len >= cmd->payload_len) {
           // Completed chunk
-          cmd->payload.assign(linebreak, cmd->payload_len);
-          evbuffer_drain(input, cmd->payload_len + line_len);
+          evbuffer_remove_buffer(input, cmd->raw, cmd->payload_len);
           cmd->payload_len = 0;
           done = true;
         } else {
-          // Read more!
-          cmd->payload.assign(linebreak, buf_len - line_len);
+          // Read more!  The pieces pile up in |raw| as they are.
+          evbuffer_remove_buffer(input, cmd->raw, buf_len - line_len);
           cmd->payload_len -= buf_len - line_len;
-          evbuffer_drain(input, buf_len);
           cmd->set_flags(Command::CHUNKED);
         }
       } else {
-        evbuffer_drain(input, line_len);
         done = true;
       }
     } else {
-      evbuffer_drain(input, line_len);
       done = true;
     }
 
   } else {
     if (buf_len >= cmd->payload_len) {
       // Last chunk
-      cmd->payload.append(buf, cmd->payload_len);
-      evbuffer_drain(input, cmd->payload_len);
+      evbuffer_remove_buffer(input, cmd->raw, cmd->payload_len);
       cmd->payload_len = 0;
       cmd->clear_flags(Command::CHUNKED);
       done = true;
     } else {
       // Read more!
-      cmd->payload.append(buf, buf_len);
+      evbuffer_remove_buffer(input, cmd->raw, buf_len);
       cmd->payload_len -= buf_len;
-      evbuffer_drain(input, buf_len);
     }
   }
 
   if (done) {
+    // only the handlers (and -P) need the payload in one piece
+    const cmd_cb handler = find_command(cmd->args[0]);
+    if (show_payload || handler)
+      linearize_payload(cmd);
 
     if (show_payload && cmd->payload.size() > 0) {
       const std::string escaped(
@@ -1460,63 +1591,27 @@ int parse_packet(bool inbound, struct evbuffer* input, Connection* conn) {
       fprintf(stderr, "\n======\n%s\n======\n", escaped.c_str());
     }
 
-    parse_cmd(cmd);
-
-    bool filtered = false;
+    if (handler)
+      (*handler)(cmd);
 
-    if (conn->session->connecting) {
+    // A login needs the database; a message waits for its conversation id.
+    const bool login = conn->session->connecting;
+    if (login || (cmd->hist != NULL && chat_id_pending(cmd))) {
       conn->session->connecting = false;
-      filtered = check_login(cmd);
-    } else if (cmd->should_ignore()) {
-      cmd->clear_flags(Command::IGNORE);
-      filtered = true;
-    }
-
-    // TODO: this isn't right.
-    if (cmd->hist != NULL) {
-      filtered = check_filter(cmd->hist, cmd->is_encrypted());
-
-      if (cmd->is_encrypted()) {
-        cmd->clear_flags(Command::ENCRYPTED);
-        // Do nothing if the message is encrypted.
-        if (!filtered)
-          cmd->hist->set_dont_log();
-      }
-
-      if (!cmd->cookie.empty()) {
-        if (filtered)
-          send_cancel_message(cmd);
-        cmd->cookie.clear();
-      }
-
-      cmd->hist->set_filtered(filtered);
-
-      do_notifies(cmd);
-
-      if (!db.has_rule(cmd->hist->local_im(), 1) ||
-          cmd->hist->dont_log()) {
-        delete cmd->hist;
-      } else {
-        HistoryLogger::instance()->log(cmd->hist);
-      }
-
-      cmd->hist = NULL;
+      suspend_command(cmd, login);
+      return 0;
     }
 
-    // Send back "ACK" message to the client if needed.
-    if (cmd->should_send_ack()) {
-      cmd->clear_flags(Command::WAITING_FOR_ACK);
-      if (filtered)
-        send_command(conn->client_bufev, "ACK " + lexical_cast<std::string>(cmd->trid));
+    bool filtered = false;
+    if (cmd->should_ignore()) {
+      cmd->clear_flags(Command::IGNORE);
+      filtered = true;
     }
 
-    if (!filtered)
-      send_message(inbound ? conn->client_bufev : conn->server_bufev, cmd->args, cmd->payload);
-
-    cmd->payload.clear();
+    release_command(cmd, filtered);
   }
 
-  if (cmd->payload.empty())
+  if (!cmd->is_chunked())
     cmd->args.clear();
 
   return 0;
@@ -30,6 +30,8 @@ enum ProtocolVersion {
 };
 
 void msn_init(void);
+void msn_stop(void);
+void msn_shutdown(void);
 void destroy_cb(Connection* conn);
 void drop_chat(Connection* conn, const std::string& buddy);
 int parse_packet(bool inbound, struct evbuffer* input, Connection* conn);
@@ -6,11 +6,16 @@
 
 #include "msn/msn_database.h"
 
-#include <boost/scoped_ptr.hpp>
+#include <cstdlib>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
 #include <boost/lexical_cast.hpp>
-#include <dolphinconn/resultset.h>
 
-#include "config.h"
+#include "msn/chat_id_allocator.h"
+#include "msn/presence_buffer.h"
 #include "log.h"
 
 using std::string;
@@ -18,19 +23,38 @@ using boost::lexical_cast;
 
 namespace msn {
 
-bool MsnDatabase::init() {
-  Config& config = Config::instance();
-  bool ret = db_.open(
-      config["db_name"], config["db_user"], config["db_password"],
-      config["db_host"], config.getint("db_port"), config["db_socket"]);
+// ER_DUP_ENTRY
+static const int kDuplicateEntry = 1062;
 
-  if (!ret) {
-    log_warn("MySQL error %d, SQLState %s: %s", db_.get_last_errno(),
-             db_.get_sqlstate(), db_.get_error_msg());
-  }
-  return ret;
+namespace {
+
+StatementCache::Params params(const string& a) {
+  return StatementCache::Params(1, a);
+}
+
+StatementCache::Params params(const string& a, const string& b) {
+  StatementCache::Params values;
+  values.push_back(a);
+  values.push_back(b);
+  return values;
+}
+
+StatementCache::Params params(const string& a, const string& b,
+                              const string& c) {
+  StatementCache::Params values(params(a, b));
+  values.push_back(c);
+  return values;
+}
+
+StatementCache::Params params(const string& a, const string& b,
+                              const string& c, const string& d) {
+  StatementCache::Params values(params(a, b, c));
+  values.push_back(d);
+  return values;
 }
 
+}  // namespace
+
 // TODO: This method should ONLY be called after a crash.
 bool MsnDatabase::cleanup() {
   string sql("UPDATE conversations SET status=0 WHERE status=1");
@@ -38,220 +62,354 @@ bool MsnDatabase::cleanup() {
 }
 
 uint64_t MsnDatabase::get_chat_id(const string& user) {
-  MutexLocker lk(mutex_);
-
-  string sql("INSERT INTO conversations(user_id, timestamp) "
-             "SELECT users.id, NOW() FROM users "
-             "WHERE users.username = '");
-  sql.append(user);
-  sql.append("'");
-
-  if (!db_.execute(sql))
+  if (!stmts_.execute("INSERT INTO conversations(user_id, timestamp) "
+                      "SELECT users.id, NOW() FROM users "
+                      "WHERE users.username = ?", params(user)))
     return 0;
-  return db_.get_last_insert_id();
+  return stmts_.last_insert_id();
 }
 
 bool MsnDatabase::delete_chat(uint64_t chat_id) {
-  string sql("UPDATE conversations SET status=0 WHERE id = ");
-  sql.append(lexical_cast<string>(chat_id));
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE conversations SET status=0 WHERE id = ?",
+                        params(lexical_cast<string>(chat_id)));
+}
+
+bool MsnDatabase::reserve_chat_ids(uint32_t count, uint32_t& first) {
+  // the row is only missing on a database created before the blocks
+  if (!stmts_.execute("INSERT IGNORE INTO conversation_ids(id, next_id) "
+                      "VALUES (1, 1)"))
+    return false;
+
+  // Past every id in use, also those AUTO_INCREMENT gave out while the
+  // blocks were off.  LAST_INSERT_ID() is per session, so all three run on
+  // the statements' one.
+  if (!stmts_.execute("UPDATE conversation_ids SET next_id = LAST_INSERT_ID("
+                      "GREATEST(next_id, (SELECT IFNULL(MAX(id), 0) + 1 "
+                      "FROM conversations)) + ?) WHERE id = 1",
+                      params(lexical_cast<string>(count))))
+    return false;
+
+  const string next = query_string("SELECT LAST_INSERT_ID()",
+                                   StatementCache::Params());
+  if (next.empty())
+    return false;
+
+  first = lexical_cast<uint32_t>(next) - count;
+  return true;
+}
+
+bool MsnDatabase::add_chats(const std::vector<NewChat>& chats) {
+  // rows per INSERT, to stay well below max_allowed_packet
+  static const size_t kRowsPerInsert = 500;
+
+  for (size_t i = 0; i < chats.size(); i += kRowsPerInsert) {
+    const size_t end = std::min(i + kRowsPerInsert, chats.size());
+
+    if (insert_chats(chats, i, end))
+      continue;
+    if (db_.get_last_errno() != kDuplicateEntry)
+      return false;
+
+    // An id of the batch was taken meanwhile; the others are written one
+    // by one.
+    for (size_t j = i; j < end; ++j) {
+      if (!insert_chats(chats, j, j + 1) &&
+          db_.get_last_errno() != kDuplicateEntry)
+        return false;
+    }
+  }
+  return true;
+}
+
+bool MsnDatabase::insert_chats(const std::vector<NewChat>& chats,
+                               size_t begin, size_t end) {
+  // Conversations of users missing from the users table are left out,
+  // as the single INSERT does.
+  string sql = "INSERT INTO conversations(id, user_id, timestamp, status) "
+               "SELECT c.id, users.id, FROM_UNIXTIME(c.ts), c.status "
+               "FROM (";
+  for (size_t i = begin; i < end; ++i) {
+    const NewChat& chat = chats[i];
+
+    if (i > begin)
+      sql.append(" UNION ALL ");
+    sql.append("SELECT " + lexical_cast<string>(chat.id) + " AS id, '");
+    sql.append(db_.escape(chat.user));
+    sql.append("' AS username, " +
+               lexical_cast<string>(static_cast<long>(chat.timestamp)));
+    sql.append(chat.closed ? " AS ts, 0 AS status" : " AS ts, 1 AS status");
+  }
+  sql.append(") c JOIN users ON users.username = c.username");
+
+  if (db_.execute(sql))
+    return true;
+
+  if (db_.get_last_errno() == kDuplicateEntry && end - begin == 1) {
+    // AUTO_INCREMENT of a proxy without the blocks got there first
+    log_warn("conversation id %u is taken, do all the proxies sharing the "
+             "database set chat_id_block_size?", chats[begin].id);
+  } else if (db_.get_last_errno() != kDuplicateEntry) {
+    log_warn("unable to store %zu conversations: MySQL error %d: %s",
+             end - begin, db_.get_last_errno(), db_.get_error_msg());
+  }
+  return false;
+}
+
+bool MsnDatabase::user_exists(const string& user) {
+  return query_bool("SELECT COUNT(*) FROM users WHERE username = ?",
+                    params(user));
 }
 
 bool MsnDatabase::add_user(const string& user) {
-  string sql("CALL sp_add_user('" + user + "')");
-  return db_.execute(sql);
+  return stmts_.execute("CALL sp_add_user(?)", params(user));
 }
 
 bool MsnDatabase::can_login(const string& user) {
-  string sql("SELECT COUNT(*) FROM users u JOIN usergroups g ON u.group_id = g.id "
-             "WHERE u.username = '");
-  sql.append(user);
-  sql.append("' AND u.isenabled = 1 AND g.isactive = 1");
-
-  boost::scoped_ptr<dolphinconn::ResultSet> sp(db_.execute_query(sql));
-  if (sp.get() && sp->step())
-    return sp->column_bool(0);
-  return false;
+  return query_bool("SELECT COUNT(*) FROM users u "
+                    "JOIN usergroups g ON u.group_id = g.id "
+                    "WHERE u.username = ? AND u.isenabled = 1 "
+                    "AND g.isactive = 1", params(user));
 }
 
 bool MsnDatabase::set_login_time(const string& user) {
-  string sql("UPDATE users SET lastlogin=NOW() WHERE username = '");
-  sql.append(user);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE users SET lastlogin=NOW() WHERE username = ?",
+                        params(user));
 }
 
 bool MsnDatabase::set_status(const string& user, const string& status) {
-  string sql("UPDATE users SET status = '" + status + "'");
-  sql.append(" WHERE username = '");
-  sql.append(user);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE users SET status = ? WHERE username = ?",
+                        params(status, user));
 }
 
 bool MsnDatabase::set_friendly_name(const string& user, const string& name) {
-  string sql("UPDATE users SET displayname = '" + db_.escape(name) + "'");
-  sql.append(" WHERE username = '");
-  sql.append(user);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE users SET displayname = ? WHERE username = ?",
+                        params(name, user));
 }
 
 bool MsnDatabase::set_status_message(const string& user, const char* msg) {
-  string sql("UPDATE users SET psm = '");
-  if (msg != NULL)
-    sql.append(db_.escape(msg));
-  sql.append("'");
-  sql.append(" WHERE username = '");
-  sql.append(user);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE users SET psm = ? WHERE username = ?",
+                        params(msg ? msg : "", user));
 }
 
 bool MsnDatabase::user_logoff(const string& user) {
-  string sql("UPDATE users SET status = 'FLN' WHERE username = '");
-  sql.append(user);
-  sql.append("'");
-  if (!db_.execute(sql))
+  if (!stmts_.execute("UPDATE users SET status = 'FLN' WHERE username = ?",
+                      params(user)))
     return false;
 
-  sql = "UPDATE buddies ";
-  sql.append("JOIN users ON users.username = '");
-  sql.append(user);
-  sql.append("'");
-  sql += " SET buddies.status = 'FLN' WHERE user_id = users.id";
-  if (!db_.execute(sql))
-    return false;
-
-  return true;
+  return stmts_.execute("UPDATE buddies JOIN users ON users.username = ? "
+                        "SET buddies.status = 'FLN' "
+                        "WHERE user_id = users.id", params(user));
 }
 
 bool MsnDatabase::add_buddy(const string& user, const string& who) {
-  string sql("INSERT IGNORE INTO buddies(user_id, username) "
-             "SELECT users.id, '" + who + "'");
-  sql.append(" FROM users WHERE users.username = '");
-  sql.append(user);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("INSERT IGNORE INTO buddies(user_id, username) "
+                        "SELECT users.id, ? FROM users "
+                        "WHERE users.username = ?", params(who, user));
+}
+
+bool MsnDatabase::add_buddies(const string& user,
+                              const std::vector<string>& who) {
+  // rows per INSERT, to stay well below max_allowed_packet
+  static const size_t kRowsPerInsert = 500;
+
+  if (who.empty())
+    return true;
+
+  const string user_id = query_string("SELECT id FROM users "
+                                      "WHERE username = ?", params(user));
+  if (user_id.empty())
+    return false;
+
+  if (!db_.execute("START TRANSACTION"))
+    return false;
+
+  // The batches differ in size, so they are not worth preparing.
+  bool ok = true;
+  for (size_t i = 0; ok && i < who.size(); i += kRowsPerInsert) {
+    const size_t end = std::min(i + kRowsPerInsert, who.size());
+
+    string sql = "INSERT IGNORE INTO buddies(user_id, username) VALUES ";
+    for (size_t j = i; j < end; ++j) {
+      if (j > i)
+        sql.append(",");
+      sql.append("(" + user_id + ", '");
+      sql.append(db_.escape(who[j]));
+      sql.append("')");
+    }
+    ok = db_.execute(sql);
+  }
+
+  if (!ok) {
+    db_.execute("ROLLBACK");
+    return false;
+  }
+  return db_.execute("COMMIT");
 }
 
 bool MsnDatabase::buddy_logoff(const string& user, const string& who) {
-  string sql("UPDATE buddies "
-             "JOIN users ON users.username = '" + user + "'");
-  sql.append(" SET buddies.status = 'FLN' "
-             "WHERE user_id = users.id AND buddies.username = '");
-  sql.append(who);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE buddies JOIN users ON users.username = ? "
+                        "SET buddies.status = 'FLN' "
+                        "WHERE user_id = users.id AND buddies.username = ?",
+                        params(user, who));
 }
 
 bool MsnDatabase::update_buddy(const string& user, const string& who,
                                const string& status, const string& name) {
-  string sql("UPDATE buddies "
-             "JOIN users ON users.username = '" + user + "'");
-  sql.append(" SET buddies.status = '" + status + "', ");
-  sql.append("buddies.displayname = '" + db_.escape(name) + "' "
-             "WHERE user_id = users.id AND buddies.username = '");
-  sql.append(who);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE buddies JOIN users ON users.username = ? "
+                        "SET buddies.status = ?, buddies.displayname = ? "
+                        "WHERE user_id = users.id AND buddies.username = ?",
+                        params(user, status, name, who));
 }
 
 bool MsnDatabase::update_buddy_status(const string& user,
                                       const string& who,
                                       const string& status) {
-  string sql("UPDATE buddies "
-             "JOIN users ON users.username = '" + user + "'");
-  sql.append(" SET buddies.status = '" + status + "' "
-             "WHERE user_id = users.id AND buddies.username = '");
-  sql.append(who);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE buddies JOIN users ON users.username = ? "
+                        "SET buddies.status = ? "
+                        "WHERE user_id = users.id AND buddies.username = ?",
+                        params(user, status, who));
 }
 
 bool MsnDatabase::set_buddy_friendly_name(const string& user,
                                           const string& who,
                                           const string& name) {
-  string sql("UPDATE buddies "
-             "JOIN users ON users.username = '" + user + "'");
-  sql.append(" SET buddies.displayname = '" + db_.escape(name) + "' "
-             "WHERE user_id = users.id AND buddies.username = '");
-  sql.append(who);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE buddies JOIN users ON users.username = ? "
+                        "SET buddies.displayname = ? "
+                        "WHERE user_id = users.id AND buddies.username = ?",
+                        params(user, name, who));
 }
 
 bool MsnDatabase::set_buddy_status_message(const string& user,
                                            const string& who,
                                            const char* msg) {
-  string sql("UPDATE buddies "
-             "JOIN users ON users.username = '" + user + "'");
-  sql.append(" SET buddies.psm = '");
-  if (msg != NULL)
-    sql.append(db_.escape(msg));
-  sql.append("'");
-  sql.append(" WHERE user_id = users.id AND buddies.username = '");
-  sql.append(who);
-  sql.append("'");
-  return db_.execute(sql);
+  return stmts_.execute("UPDATE buddies JOIN users ON users.username = ? "
+                        "SET buddies.psm = ? "
+                        "WHERE user_id = users.id AND buddies.username = ?",
+                        params(user, msg ? msg : "", who));
+}
+
+bool MsnDatabase::update_presence(const string& user,
+                                  const UserPresence& presence) {
+  // by Presence::Field
+  static const char* const kColumns[] = { "status", "displayname", "psm" };
+  // buddies per UPDATE
+  static const size_t kBuddiesPerUpdate = 500;
+
+  bool ok = true;
+
+  string sets;
+  StatementCache::Params values;
+  for (int field = 0; field < Presence::FIELDS; ++field) {
+    if (!presence.self.set[field])
+      continue;
+
+    if (!sets.empty())
+      sets.append(", ");
+    sets.append(kColumns[field]);
+    sets.append(" = ?");
+    values.push_back(presence.self.value[field]);
+  }
+
+  if (!sets.empty()) {
+    values.push_back(user);
+    ok = stmts_.execute("UPDATE users SET " + sets + " WHERE username = ?",
+                        values);
+  }
+
+  // One UPDATE per batch of buddies, setting each column to the buddy's
+  // new value or leaving it as it is; these have too many shapes to be
+  // prepared:
+  //   SET buddies.status = CASE buddies.username WHEN 'a' THEN 'NLN' ...
+  //                        ELSE buddies.status END, ...
+  UserPresence::Buddies::const_iterator it = presence.buddies.begin();
+  while (it != presence.buddies.end()) {
+    std::vector<std::pair<string, const Presence*> > batch;
+    for (; it != presence.buddies.end() && batch.size() < kBuddiesPerUpdate;
+         ++it)
+      batch.push_back(std::make_pair(db_.escape(it->first), &it->second));
+
+    string sql("UPDATE buddies JOIN users ON users.username = '" +
+               db_.escape(user) + "' SET ");
+    bool first_column = true;
+    for (int field = 0; field < Presence::FIELDS; ++field) {
+      string cases;
+      for (size_t i = 0; i < batch.size(); ++i) {
+        const Presence& p = *batch[i].second;
+        if (!p.set[field])
+          continue;
+        cases.append(" WHEN '" + batch[i].first + "' THEN '");
+        cases.append(db_.escape(p.value[field]));
+        cases.append("'");
+      }
+      if (cases.empty())
+        continue;
+
+      if (!first_column)
+        sql.append(", ");
+      first_column = false;
+
+      const string column = string("buddies.") + kColumns[field];
+      sql.append(column + " = CASE buddies.username" + cases);
+      sql.append(" ELSE " + column + " END");
+    }
+
+    sql.append(" WHERE buddies.user_id = users.id AND buddies.username IN (");
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (i > 0)
+        sql.append(", ");
+      sql.append("'" + batch[i].first + "'");
+    }
+    sql.append(")");
+
+    if (!db_.execute(sql))
+      ok = false;
+  }
+
+  return ok;
 }
 
 bool MsnDatabase::buddy_is_blocked(const string& user, const string& who) {
-  string sql("SELECT COUNT(*) FROM buddies b JOIN users u ON u.username = '");
-  sql.append(user);
-  sql.append("' WHERE user_id = u.id AND b.username = '");
-  sql.append(who);
-  sql.append("' AND b.isblocked = 1");
-
-  boost::scoped_ptr<dolphinconn::ResultSet> sp(db_.execute_query(sql));
-  if (sp.get() && sp->step())
-    return sp->column_bool(0);
-  return false;
+  return query_bool("SELECT COUNT(*) FROM buddies b "
+                    "JOIN users u ON u.username = ? "
+                    "WHERE user_id = u.id AND b.username = ? "
+                    "AND b.isblocked = 1", params(user, who));
 }
 
 bool MsnDatabase::check_version(int version) {
-  string sql("SELECT fn_check_version(");
-  sql.append(lexical_cast<string>(version));
-  sql.append(")");
-
-  boost::scoped_ptr<dolphinconn::ResultSet> sp(db_.execute_query(sql));
-  if (sp.get() && sp->step())
-    return sp->column_bool(0);
-  return false;
+  return query_bool("SELECT fn_check_version(?)",
+                    params(lexical_cast<string>(version)));
 }
 
 bool MsnDatabase::has_rule(const string& user, int type) {
-  string sql("SELECT COUNT(*) FROM grouprules r JOIN users u ON u.username = '");
-  sql.append(user);
-  sql.append("' WHERE rule_id = ");
-  sql.append(lexical_cast<string>(type));
-  sql.append(" AND r.group_id = u.group_id");
-
-  boost::scoped_ptr<dolphinconn::ResultSet> sp(db_.execute_query(sql));
-  if (sp.get() && sp->step())
-    return sp->column_bool(0);
-  return false;
+  return query_bool("SELECT COUNT(*) FROM grouprules r "
+                    "JOIN users u ON u.username = ? "
+                    "WHERE rule_id = ? AND r.group_id = u.group_id",
+                    params(user, lexical_cast<string>(type)));
 }
 
 string MsnDatabase::get_rule_value(int type) {
-  string sql("SELECT rulevalue FROM rules WHERE id = ");
-  sql.append(lexical_cast<string>(type));
-
-  boost::scoped_ptr<dolphinconn::ResultSet> sp(db_.execute_query(sql));
-  if (sp.get() && sp->step())
-    return sp->column_string(0);
-  return "";
+  return query_string("SELECT rulevalue FROM rules WHERE id = ?",
+                      params(lexical_cast<string>(type)));
 }
 
 string MsnDatabase::get_setting(const string& name) {
-  string sql("SELECT value FROM settings WHERE name = '");
-  sql.append(name);
-  sql.append("'");
-
-  boost::scoped_ptr<dolphinconn::ResultSet> sp(db_.execute_query(sql));
-  if (sp.get() && sp->step())
-    return sp->column_string(0);
-  return "";
+  return query_string("SELECT value FROM settings WHERE name = ?",
+                      params(name));
+}
+
+bool MsnDatabase::query_bool(const string& sql,
+                             const StatementCache::Params& values) {
+  string value;
+  if (!stmts_.query(sql, values, value))
+    return false;
+  return atoi(value.c_str()) != 0;
+}
+
+string MsnDatabase::query_string(const string& sql,
+                                 const StatementCache::Params& values) {
+  string value;
+  stmts_.query(sql, values, value);
+  return value;
 }
 
 }  // namespace msn
@@ -10,25 +10,38 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include <boost/noncopyable.hpp>
 #include <dolphinconn/connection.h>
 
-#include "thread/mutex.h"
+#include "connection_pool.h"
+#include "statement_cache.h"
 
 namespace msn {
 
+struct NewChat;
+struct UserPresence;
+
+// The queries of the proxy, on a connection of the pool.
 class MsnDatabase : private boost::noncopyable {
  public:
-  MsnDatabase() { }
+  explicit MsnDatabase(PooledConnection& conn)
+      : db_(conn.db()),
+        stmts_(conn.statements()) { }
 
-  bool init();
   bool cleanup();
 
   dolphinconn::Connection& db() { return db_; }
 
   uint64_t get_chat_id(const std::string& user);
   bool delete_chat(uint64_t chat_id);
+  // Reserves |count| conversation ids, from |first| on, for ChatIdAllocator.
+  bool reserve_chat_ids(uint32_t count, uint32_t& first);
+  // Writes the rows of conversations whose ids were reserved, a few per
+  // statement.  Ids already taken are logged and skipped.
+  bool add_chats(const std::vector<NewChat>& chats);
+  bool user_exists(const std::string& user);
   bool add_user(const std::string& user);
   bool can_login(const std::string& user);
   bool set_login_time(const std::string& user);
@@ -37,6 +50,9 @@ class MsnDatabase : private boost::noncopyable {
   bool set_status_message(const std::string& user, const char* msg);
   bool user_logoff(const std::string& user);
   bool add_buddy(const std::string& user, const std::string& who);
+  // All of |who| at once, in one transaction.
+  bool add_buddies(const std::string& user,
+                   const std::vector<std::string>& who);
   bool buddy_logoff(const std::string& user, const std::string& who);
   bool update_buddy(const std::string& user, const std::string& who,
                     const std::string& status, const std::string& name);
@@ -48,6 +64,10 @@ class MsnDatabase : private boost::noncopyable {
   bool set_buddy_status_message(const std::string& user,
                                 const std::string& who,
                                 const char* msg);
+  // Writes what PresenceBuffer collected for |user|, a few buddies per
+  // statement.
+  bool update_presence(const std::string& user,
+                       const UserPresence& presence);
   bool buddy_is_blocked(const std::string& user, const std::string& who);
   bool check_version(int version);
   bool has_rule(const std::string& user, int type);
@@ -55,8 +75,18 @@ class MsnDatabase : private boost::noncopyable {
   std::string get_setting(const std::string& name);
 
  private:
-  Mutex mutex_;
-  dolphinconn::Connection db_;
+  // One INSERT of chats[begin, end).
+  bool insert_chats(const std::vector<NewChat>& chats, size_t begin,
+                    size_t end);
+
+  // the first column of the first row, false or "" if there is none
+  bool query_bool(const std::string& sql,
+                  const StatementCache::Params& values);
+  std::string query_string(const std::string& sql,
+                           const StatementCache::Params& values);
+
+  dolphinconn::Connection& db_;
+  StatementCache& stmts_;
 };
 
 } // namespace msn
@@ -0,0 +1,316 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "msn/policy.h"
+
+#include <cctype>
+#include <cstdlib>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/lexical_cast.hpp>
+#include <dolphinconn/connection.h>
+#include <dolphinconn/resultset.h>
+#include <event.h>
+#include <evutil.h>
+
+#include "msn/async_database.h"
+#include "msn/msn_database.h"
+#include "connection_pool.h"
+#include "thread/mutex.h"
+#include "config.h"
+#include "defs.h"
+#include "utils.h"
+#include "log.h"
+
+using std::string;
+using boost::lexical_cast;
+
+namespace msn {
+
+namespace {
+
+static PolicyPointer current;
+// one refresh at a time, so that an older load never replaces a newer one
+static Mutex refresh_mutex;
+
+static AsyncDatabase* async_db = NULL;
+static struct event ev_refresh;
+static int refresh_interval = 60;
+
+// usernames compare case-insensitively in MySQL
+string lower(const string& s) {
+  string ret(s);
+  for (size_t i = 0; i < ret.size(); ++i)
+    ret[i] = tolower(ret[i]);
+  return ret;
+}
+
+bool load_users(dolphinconn::Connection& db, const string& where,
+                PolicySnapshot::UserGroups& users) {
+  boost::scoped_ptr<dolphinconn::ResultSet> res(db.execute_query("SELECT "
+        "username, group_id FROM users" + where));
+  if (!res)
+    return false;
+
+  while (res->step())
+    users[lower(res->column_string(0))] = res->column_int(1);
+  return true;
+}
+
+bool load_group_rules(dolphinconn::Connection& db,
+                      PolicySnapshot::GroupRules& rules) {
+  boost::scoped_ptr<dolphinconn::ResultSet> res(db.execute_query("SELECT "
+        "group_id, rule_id FROM grouprules"));
+  if (!res)
+    return false;
+
+  while (res->step()) {
+    int rule = res->column_int(1);
+    if (rule <= 0 || rule >= 32) {
+      log_warn("ignoring rule %d, only rules 1 to 31 are supported", rule);
+      continue;
+    }
+    rules[res->column_int(0)] |= SET_BIT_32(rule);
+  }
+  return true;
+}
+
+bool load_settings(dolphinconn::Connection& db,
+                   PolicySnapshot::Settings& settings) {
+  boost::scoped_ptr<dolphinconn::ResultSet> res(db.execute_query("SELECT "
+        "name, value FROM settings"));
+  if (!res)
+    return false;
+
+  while (res->step())
+    settings[res->column_string(0)] = res->column_string(1);
+  return true;
+}
+
+bool load_blocked(dolphinconn::Connection& db,
+                  PolicySnapshot::BlockedBuddies& blocked) {
+  boost::scoped_ptr<dolphinconn::ResultSet> res(db.execute_query("SELECT "
+        "u.username, b.username FROM buddies b JOIN users u "
+        "ON u.id = b.user_id WHERE b.isblocked = 1"));
+  if (!res)
+    return false;
+
+  while (res->step())
+    blocked.insert(lower(res->column_string(0)) + " " +
+                   lower(res->column_string(1)));
+  return true;
+}
+
+class RefreshJob : public DatabaseJob {
+ public:
+  RefreshJob() : DatabaseJob(NULL) {}
+
+  void execute(MsnDatabase& database) {
+    policy_refresh(database);
+  }
+};
+
+// update everything.
+void refresh_policy(int fd, short event, void* arg) {
+  struct timeval tv;
+
+  evutil_timerclear(&tv);
+  tv.tv_sec = refresh_interval;
+  event_add(&ev_refresh, &tv);
+
+  DLOG(1, "--== Refreshing policy ==--");
+
+  async_db->submit("policy", new RefreshJob);
+}
+
+}  // namespace
+
+PolicySnapshot::PolicySnapshot()
+    : users_(new UserGroups),
+      group_rules_(new GroupRules),
+      settings_(new Settings),
+      blocked_(new BlockedBuddies),
+      users_max_id_(0),
+      version_(0) {
+}
+
+// static
+PolicySnapshot* PolicySnapshot::load(MsnDatabase& database,
+                                     const PolicySnapshot* old) {
+  PolicySnapshot* snapshot = new PolicySnapshot;
+  bool changed = old == NULL;
+
+  if (!snapshot->update(database.db(), old, &changed) || !changed) {
+    delete snapshot;
+    return NULL;
+  }
+
+  snapshot->version_ = old ? old->version_ + 1 : 1;
+
+  DLOG(1, "policy version %llu: %zu users, %zu groups, %zu blocked buddies",
+       static_cast<unsigned long long>(snapshot->version_),
+       snapshot->users_->size(), snapshot->group_rules_->size(),
+       snapshot->blocked_->size());
+
+  return snapshot;
+}
+
+bool PolicySnapshot::update(dolphinconn::Connection& db,
+                            const PolicySnapshot* old, bool* changed) {
+  static const char* const users_fp_sql = "SELECT COUNT(*), MAX(id), "
+      "BIT_XOR(CRC32(CONCAT_WS(':', id, username, group_id))) FROM users";
+
+  users_fp_ = utils::table_fingerprint(db, users_fp_sql);
+  if (users_fp_.empty())
+    return false;
+  users_max_id_ = utils::fingerprint_max_id(users_fp_);
+
+  if (old && old->users_fp_ == users_fp_) {
+    users_ = old->users_;
+  } else {
+    string old_max = lexical_cast<string>(old ? old->users_max_id_ : 0);
+    UserGroups* users = new UserGroups;
+    users_.reset(users);
+
+    // Usually users were only added; then the rows that were there before
+    // are unchanged and only the new ones need to be fetched.
+    if (old && old->users_max_id_ < users_max_id_ &&
+        utils::table_fingerprint(db, string(users_fp_sql) +
+                                 " WHERE id <= " + old_max) == old->users_fp_) {
+      *users = *old->users_;
+      if (!load_users(db, " WHERE id > " + old_max, *users))
+        return false;
+    } else if (!load_users(db, "", *users)) {
+      return false;
+    }
+    *changed = true;
+  }
+
+  group_rules_fp_ = utils::table_fingerprint(db, "SELECT COUNT(*), MAX(id), "
+      "BIT_XOR(CRC32(CONCAT_WS(':', rule_id, group_id))) FROM grouprules");
+  if (group_rules_fp_.empty())
+    return false;
+
+  if (old && old->group_rules_fp_ == group_rules_fp_) {
+    group_rules_ = old->group_rules_;
+  } else {
+    GroupRules* rules = new GroupRules;
+    group_rules_.reset(rules);
+    if (!load_group_rules(db, *rules))
+      return false;
+    *changed = true;
+  }
+
+  settings_fp_ = utils::table_fingerprint(db, "SELECT COUNT(*), MAX(id), "
+      "BIT_XOR(CRC32(CONCAT_WS(':', name, value))) FROM settings");
+  if (settings_fp_.empty())
+    return false;
+
+  if (old && old->settings_fp_ == settings_fp_) {
+    settings_ = old->settings_;
+  } else {
+    Settings* settings = new Settings;
+    settings_.reset(settings);
+    if (!load_settings(db, *settings))
+      return false;
+    *changed = true;
+  }
+
+  blocked_fp_ = utils::table_fingerprint(db, "SELECT COUNT(*), MAX(id), "
+      "BIT_XOR(CRC32(CONCAT_WS(':', user_id, username))) FROM buddies "
+      "WHERE isblocked = 1");
+  if (blocked_fp_.empty())
+    return false;
+
+  if (old && old->blocked_fp_ == blocked_fp_) {
+    blocked_ = old->blocked_;
+  } else {
+    BlockedBuddies* blocked = new BlockedBuddies;
+    blocked_.reset(blocked);
+    if (!load_blocked(db, *blocked))
+      return false;
+    *changed = true;
+  }
+
+  return true;
+}
+
+uint32_t PolicySnapshot::rules(const string& user) const {
+  // no rules for a user without a row, as has_rule's JOIN had it
+  UserGroups::const_iterator user_it = users_->find(lower(user));
+  if (user_it == users_->end())
+    return 0;
+
+  GroupRules::const_iterator it = group_rules_->find(user_it->second);
+  if (it == group_rules_->end())
+    return 0;
+  return it->second;
+}
+
+bool PolicySnapshot::has_user(const string& user) const {
+  return users_->count(lower(user)) > 0;
+}
+
+bool PolicySnapshot::buddy_is_blocked(const string& user,
+                                      const string& who) const {
+  return blocked_->count(lower(user) + " " + lower(who)) > 0;
+}
+
+string PolicySnapshot::get_setting(const string& name) const {
+  Settings::const_iterator it = settings_->find(name);
+  if (it == settings_->end())
+    return "";
+  return it->second;
+}
+
+void policy_init(AsyncDatabase* db) {
+  struct timeval tv;
+
+  async_db = db;
+
+  int interval = Config::instance().getint("policy_refresh_interval");
+  if (interval > 0)
+    refresh_interval = interval;
+
+  // initial load
+  PolicySnapshot* snapshot = NULL;
+  {
+    ConnectionLease conn;
+    if (conn->connected()) {
+      MsnDatabase database(*conn);
+      snapshot = PolicySnapshot::load(database, NULL);
+    }
+  }
+
+  if (snapshot == NULL) {
+    log_warn("unable to load the policy, retrying in %d seconds",
+             refresh_interval);
+    // empty until the next refresh
+    snapshot = new PolicySnapshot;
+  }
+  boost::atomic_store(&current, PolicyPointer(snapshot));
+
+  evtimer_set(&ev_refresh, refresh_policy, NULL);
+  evutil_timerclear(&tv);
+  tv.tv_sec = refresh_interval;
+  event_add(&ev_refresh, &tv);
+}
+
+void policy_refresh(MsnDatabase& database) {
+  MutexLocker lock(refresh_mutex);
+
+  PolicyPointer old = boost::atomic_load(&current);
+
+  PolicySnapshot* snapshot = PolicySnapshot::load(database, old.get());
+  if (snapshot != NULL)
+    boost::atomic_store(&current, PolicyPointer(snapshot));
+}
+
+PolicyPointer policy_snapshot() {
+  return boost::atomic_load(&current);
+}
+
+}  // namespace msn
@@ -0,0 +1,92 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef MSN_POLICY_H_
+#define MSN_POLICY_H_
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+namespace dolphinconn {
+class Connection;
+}
+
+namespace msn {
+
+class AsyncDatabase;
+class MsnDatabase;
+
+// A read-only copy of the users, grouprules, settings and blocked buddies,
+// so the per-message checks need no SQL.  A refresh only reloads the tables
+// that changed and shares the others with the previous snapshot.
+class PolicySnapshot : private boost::noncopyable {
+ public:
+  typedef boost::unordered_map<std::string, uint32_t> UserGroups;
+  typedef boost::unordered_map<uint32_t, uint32_t> GroupRules;
+  typedef boost::unordered_map<std::string, std::string> Settings;
+  typedef boost::unordered_set<std::string> BlockedBuddies;
+
+  // An empty policy: no rules, nothing blocked.
+  PolicySnapshot();
+
+  // Loads the tables that changed since |old|, which may be NULL.  Returns
+  // NULL on error or if nothing changed.
+  static PolicySnapshot* load(MsnDatabase& database,
+                              const PolicySnapshot* old);
+
+  // The rules of |user|'s group as a mask of SET_BIT_32(rule id).
+  uint32_t rules(const std::string& user) const;
+
+  // Whether |user| has a row in users, as of the snapshot.
+  bool has_user(const std::string& user) const;
+
+  bool buddy_is_blocked(const std::string& user, const std::string& who) const;
+  std::string get_setting(const std::string& name) const;
+
+  // Bumped by every refresh that changed something.
+  uint64_t version() const { return version_; }
+
+ private:
+  // Shares the tables that are unchanged since |old| and loads the others,
+  // setting |changed| if any was loaded.
+  bool update(dolphinconn::Connection& db, const PolicySnapshot* old,
+              bool* changed);
+
+  boost::shared_ptr<const UserGroups> users_;
+  boost::shared_ptr<const GroupRules> group_rules_;
+  boost::shared_ptr<const Settings> settings_;
+  boost::shared_ptr<const BlockedBuddies> blocked_;
+
+  std::string users_fp_;
+  std::string group_rules_fp_;
+  std::string settings_fp_;
+  std::string blocked_fp_;
+
+  uint32_t users_max_id_;
+  uint64_t version_;
+};
+
+typedef boost::shared_ptr<const PolicySnapshot> PolicyPointer;
+
+void policy_init(AsyncDatabase* db);
+
+// Loads what changed since the current snapshot and publishes it; on a
+// database thread.
+void policy_refresh(MsnDatabase& database);
+
+// The current snapshot; it stays valid for as long as the caller holds it.
+PolicyPointer policy_snapshot();
+
+} // namespace msn
+
+#endif // MSN_POLICY_H_
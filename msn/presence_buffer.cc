@@ -0,0 +1,63 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "msn/presence_buffer.h"
+
+#include "log.h"
+
+namespace msn {
+
+void PresenceBuffer::set(const std::string& user, Presence::Field field,
+                         const std::string& value) {
+  MutexLocker lock(mutex_);
+  assign(users_[user].self, field, value);
+}
+
+void PresenceBuffer::set_buddy(const std::string& user,
+                               const std::string& who,
+                               Presence::Field field,
+                               const std::string& value) {
+  MutexLocker lock(mutex_);
+  assign(users_[user].buddies[who], field, value);
+}
+
+void PresenceBuffer::take_all(Users& users) {
+  MutexLocker lock(mutex_);
+
+  if (updates_ > 0) {
+    DLOG(1, "flushing presence: %zu updates, %zu of them overwritten",
+         updates_, overwritten_);
+  }
+
+  users.swap(users_);
+  updates_ = 0;
+  overwritten_ = 0;
+}
+
+bool PresenceBuffer::take(const std::string& user, UserPresence& presence) {
+  MutexLocker lock(mutex_);
+
+  Users::iterator it = users_.find(user);
+  if (it == users_.end())
+    return false;
+
+  presence.self = it->second.self;
+  presence.buddies.swap(it->second.buddies);
+  users_.erase(it);
+  return true;
+}
+
+void PresenceBuffer::assign(Presence& presence, Presence::Field field,
+                            const std::string& value) {
+  ++updates_;
+  if (presence.set[field])
+    ++overwritten_;
+
+  presence.set[field] = true;
+  presence.value[field] = value;
+}
+
+}  // namespace msn
@@ -0,0 +1,80 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef MSN_PRESENCE_BUFFER_H_
+#define MSN_PRESENCE_BUFFER_H_
+#pragma once
+
+#include <string>
+
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "thread/mutex.h"
+
+namespace msn {
+
+// The presence fields of a user or of one of his buddies that are still to
+// be written; only the latest value of each counts.
+struct Presence {
+  enum Field {
+    STATUS,
+    FRIENDLY_NAME,
+    STATUS_MESSAGE,
+    FIELDS
+  };
+
+  Presence() {
+    for (int i = 0; i < FIELDS; ++i)
+      set[i] = false;
+  }
+
+  bool set[FIELDS];
+  std::string value[FIELDS];
+};
+
+struct UserPresence {
+  typedef boost::unordered_map<std::string, Presence> Buddies;
+
+  Presence self;
+  Buddies buddies;
+};
+
+// Write-behind buffer for presence updates, which mostly overwrite each
+// other within seconds: the updates are kept by (user, buddy, field) until
+// the next flush takes them out.  Safe to use from any thread.
+class PresenceBuffer : private boost::noncopyable {
+ public:
+  typedef boost::unordered_map<std::string, UserPresence> Users;
+
+  PresenceBuffer() : updates_(0), overwritten_(0) { }
+
+  void set(const std::string& user, Presence::Field field,
+           const std::string& value);
+  void set_buddy(const std::string& user, const std::string& who,
+                 Presence::Field field, const std::string& value);
+
+  // Moves all that is pending into |users|, which should be empty.
+  void take_all(Users& users);
+
+  // Moves what is pending for |user| into |presence|; returns false if
+  // there is nothing.
+  bool take(const std::string& user, UserPresence& presence);
+
+ private:
+  void assign(Presence& presence, Presence::Field field,
+              const std::string& value);
+
+  Mutex mutex_;
+  Users users_;
+  // since the last take_all()
+  size_t updates_;
+  size_t overwritten_;
+};
+
+}  // namespace msn
+
+#endif  // MSN_PRESENCE_BUFFER_H_
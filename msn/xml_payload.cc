@@ -0,0 +1,258 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "msn/xml_payload.h"
+
+#include <cstdlib>
+#include <cstring>
+
+#include <libxml/parser.h>
+
+namespace msn {
+
+namespace {
+
+inline bool is(const xmlChar* name, const char* what) {
+  return xmlStrEqual(name, reinterpret_cast<const xmlChar*>(what));
+}
+
+// Feeds a payload to libxml2's push parser and hands the elements to a
+// subclass as they go by.  Depths count from the root element, which is 0.
+class SaxWalker {
+ public:
+  SaxWalker()
+      : ctxt_(NULL), depth_(0), text_(NULL), text_depth_(0),
+        stopped_(false) { }
+  virtual ~SaxWalker() { }
+
+  bool walk(const char* data, size_t size) {
+    xmlSAXHandler handler;
+    memset(&handler, 0, sizeof(handler));
+    handler.initialized = XML_SAX2_MAGIC;
+    handler.startElementNs = &start_cb;
+    handler.endElementNs = &end_cb;
+    handler.characters = &characters_cb;
+    handler.cdataBlock = &characters_cb;
+
+    ctxt_ = xmlCreatePushParserCtxt(&handler, this, NULL, 0, NULL);
+    if (ctxt_ == NULL)
+      return false;
+
+    xmlParseChunk(ctxt_, data, static_cast<int>(size), 1);
+    bool ok = ctxt_->wellFormed || stopped_;
+
+    xmlFreeParserCtxt(ctxt_);
+    ctxt_ = NULL;
+    return ok;
+  }
+
+ protected:
+  virtual void start(const xmlChar* name, int depth,
+                     const xmlChar** attrs, int nattrs) = 0;
+  virtual void end(const xmlChar* name, int depth) { }
+
+  // Collects the text of the element just started into |text| until it
+  // ends; like xmlNodeListGetString(), only its own text counts.
+  void capture(std::string* text) {
+    text->clear();
+    text_ = text;
+    text_depth_ = depth_;
+  }
+
+  // Skips the rest of the payload.
+  void stop() {
+    stopped_ = true;
+    xmlStopParser(ctxt_);
+  }
+
+  static bool attribute(const xmlChar** attrs, int nattrs, const char* name,
+                        std::string& value) {
+    // localname, prefix, URI, value, end of value
+    for (int i = 0; i < nattrs; ++i, attrs += 5) {
+      if (is(attrs[0], name)) {
+        value.assign(reinterpret_cast<const char*>(attrs[3]),
+                     attrs[4] - attrs[3]);
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  static void start_cb(void* ctx, const xmlChar* localname,
+                       const xmlChar* prefix, const xmlChar* uri,
+                       int nb_namespaces, const xmlChar** namespaces,
+                       int nb_attributes, int nb_defaulted,
+                       const xmlChar** attributes) {
+    SaxWalker* walker = static_cast<SaxWalker*>(ctx);
+    walker->start(localname, walker->depth_, attributes, nb_attributes);
+    walker->depth_++;
+  }
+
+  static void end_cb(void* ctx, const xmlChar* localname,
+                     const xmlChar* prefix, const xmlChar* uri) {
+    SaxWalker* walker = static_cast<SaxWalker*>(ctx);
+    walker->depth_--;
+    if (walker->text_ && walker->depth_ == walker->text_depth_)
+      walker->text_ = NULL;
+    walker->end(localname, walker->depth_);
+  }
+
+  static void characters_cb(void* ctx, const xmlChar* ch, int len) {
+    SaxWalker* walker = static_cast<SaxWalker*>(ctx);
+    if (walker->text_ && walker->depth_ == walker->text_depth_ + 1)
+      walker->text_->append(reinterpret_cast<const char*>(ch), len);
+  }
+
+  xmlParserCtxtPtr ctxt_;
+  int depth_;
+  std::string* text_;
+  int text_depth_;
+  bool stopped_;
+};
+
+// <ml><d n="domain"><c n="name" t="1"/>...</d>...</ml>
+class AdlWalker : public SaxWalker {
+ public:
+  explicit AdlWalker(std::vector<std::string>& contacts)
+      : contacts_(contacts), in_domain_(false) { }
+
+ private:
+  void start(const xmlChar* name, int depth, const xmlChar** attrs,
+             int nattrs) {
+    if (depth == 1 && is(name, "d")) {
+      in_domain_ = attribute(attrs, nattrs, "n", domain_);
+    } else if (depth == 2 && in_domain_ && is(name, "c")) {
+      if (!attribute(attrs, nattrs, "n", contact_) ||
+          !attribute(attrs, nattrs, "t", type_))
+        return;
+
+      int type = strtol(type_.c_str(), NULL, 10);
+      if (type == 9 || type == 32)
+        return;
+
+      contacts_.push_back(contact_ + "@" + domain_);
+    }
+  }
+
+  void end(const xmlChar* name, int depth) {
+    if (depth == 1)
+      in_domain_ = false;
+  }
+
+  std::vector<std::string>& contacts_;
+  bool in_domain_;
+  std::string domain_;
+  std::string contact_;
+  std::string type_;
+};
+
+// <Data><PSM>...</PSM>...</Data>
+class PsmWalker : public SaxWalker {
+ public:
+  PsmWalker(std::string& psm, bool& found) : psm_(psm), found_(found) {
+    found_ = false;
+  }
+
+ private:
+  void start(const xmlChar* name, int depth, const xmlChar** attrs,
+             int nattrs) {
+    if (depth == 1 && is(name, "PSM")) {
+      found_ = true;
+      capture(&psm_);
+    }
+  }
+
+  void end(const xmlChar* name, int depth) {
+    if (depth == 1 && found_)
+      stop();
+  }
+
+  std::string& psm_;
+  bool& found_;
+};
+
+// <user><s n="IM"><Status>...</Status></s><s n="PE"><PSM>...</PSM>
+// <FriendlyName>...</FriendlyName></s>...</user>
+class UserWalker : public SaxWalker {
+ public:
+  explicit UserWalker(UserStatus& status)
+      : status_(status), in_s_(false), field_(NONE) { }
+
+ private:
+  enum Field { NONE, STATUS, FRIENDLY_NAME, PSM };
+
+  void start(const xmlChar* name, int depth, const xmlChar** attrs,
+             int nattrs) {
+    if (depth == 1) {
+      in_s_ = is(name, "s");
+    } else if (depth == 2 && in_s_) {
+      if (is(name, "Status"))
+        field_ = STATUS;
+      else if (is(name, "FriendlyName"))
+        field_ = FRIENDLY_NAME;
+      else if (is(name, "PSM"))
+        field_ = PSM;
+      else
+        return;
+
+      capture(&text_);
+    }
+  }
+
+  void end(const xmlChar* name, int depth) {
+    if (depth == 1) {
+      in_s_ = false;
+    } else if (depth == 2 && field_ != NONE) {
+      switch (field_) {
+        case STATUS:
+          if (!text_.empty()) {
+            status_.has_status = true;
+            status_.status = text_;
+          }
+          break;
+        case FRIENDLY_NAME:
+          if (!text_.empty()) {
+            status_.has_friendly_name = true;
+            status_.friendly_name = text_;
+          }
+          break;
+        case PSM:
+          status_.has_psm = true;
+          status_.psm = text_;
+          break;
+        case NONE:
+          break;
+      }
+      field_ = NONE;
+    }
+  }
+
+  UserStatus& status_;
+  bool in_s_;
+  Field field_;
+  std::string text_;
+};
+
+}  // namespace
+
+bool parse_adl(const char* data, size_t size,
+               std::vector<std::string>& contacts) {
+  AdlWalker walker(contacts);
+  return walker.walk(data, size);
+}
+
+bool parse_psm(const char* data, size_t size, std::string& psm, bool& found) {
+  PsmWalker walker(psm, found);
+  return walker.walk(data, size);
+}
+
+bool parse_user_status(const char* data, size_t size, UserStatus& status) {
+  UserWalker walker(status);
+  return walker.walk(data, size);
+}
+
+}  // namespace msn
@@ -0,0 +1,46 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef MSN_XML_PAYLOAD_H_
+#define MSN_XML_PAYLOAD_H_
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Readers for the XML payloads the proxy looks into.  Each walks the
+// payload once with libxml2's SAX interface and keeps only what it is
+// after, so no document tree is built.  All return false if the payload is
+// not well-formed XML.
+namespace msn {
+
+// The contacts of an ADL, as "name@domain", except circles (type 9) and
+// networks (type 32).
+bool parse_adl(const char* data, size_t size,
+               std::vector<std::string>& contacts);
+
+// The <PSM> of a UBX or UUX.  |found| tells whether there is one at all.
+bool parse_psm(const char* data, size_t size, std::string& psm, bool& found);
+
+// What a user+xml document (NFY PUT, PUT) says about the user.  Status and
+// friendly name count only when not empty, like the PSM in parse_psm().
+struct UserStatus {
+  UserStatus()
+      : has_status(false), has_friendly_name(false), has_psm(false) { }
+
+  bool has_status;
+  std::string status;
+  bool has_friendly_name;
+  std::string friendly_name;
+  bool has_psm;
+  std::string psm;
+};
+
+bool parse_user_status(const char* data, size_t size, UserStatus& status);
+
+}  // namespace msn
+
+#endif  // MSN_XML_PAYLOAD_H_
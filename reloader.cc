@@ -0,0 +1,53 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "reloader.h"
+
+Reloader* Reloader::instance_ = NULL;
+
+Reloader::Reloader() {
+}
+
+Reloader::~Reloader() {
+}
+
+// static
+Reloader* Reloader::instance() {
+  if (instance_ == NULL) {
+    instance_ = new Reloader;
+    instance_->set_joinable(true);
+    instance_->start();
+  }
+
+  return instance_;
+}
+
+// static
+void Reloader::destroy() {
+  if (instance_) {
+    instance_->queue_.push(NULL);
+    instance_->join();
+
+    delete instance_;
+    instance_ = NULL;
+  }
+}
+
+void Reloader::submit(reload_cb cb) {
+  queue_.push(cb);
+}
+
+void Reloader::run() {
+  for (;;) {
+    reload_cb cb = queue_.pop();
+
+    bool quit_loop = cb == NULL;
+    if (quit_loop)
+      break;
+
+    (*cb)();
+  }
+}
@@ -0,0 +1,39 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef RELOADER_H_
+#define RELOADER_H_
+#pragma once
+
+#include "concurrent_queue.h"
+#include "thread/thread.h"
+
+// The thread reloading what is rebuilt from the database, the acl index
+// and the badwords.  A reload holds a connection of the pool only to read
+// the rows; neither the loops nor the database threads, which serve the
+// users, wait while it builds.
+class Reloader : public Thread {
+ public:
+  typedef void (*reload_cb)();
+
+  static Reloader* instance();
+  static void destroy();
+
+  // Runs |cb| on the reloader thread.
+  void submit(reload_cb cb);
+
+  void run();
+
+ private:
+  Reloader();
+  ~Reloader();
+
+  static Reloader* instance_;
+
+  ConcurrentQueue<reload_cb> queue_;
+};
+
+#endif // RELOADER_H_
@@ -22,35 +22,52 @@
 #include <evutil.h>
 
 #include "connection.h"
+#include "worker.h"
+#include "config.h"
 #include "log.h"
 #include "utils.h"
 
-Server::Server(const char* address, int port)
-    : ev_(new struct event),
-      fd_(-1) {
+Server::Server(const char* address, int port, Worker* worker,
+               bool reuse_port)
+    : worker_(worker),
+      ev_(new struct event),
+      fd_(-1),
+      reuse_port_(reuse_port) {
   struct sockaddr_in sin;
   memset(&sin, 0, sizeof(sin));
   sin.sin_family = AF_INET;
   sin.sin_port = htons(port);
   inet_aton(address, &sin.sin_addr);
 
-  // TODO: error handling
   fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd_ < 0)
+    err(1, "socket");
   evutil_make_socket_nonblocking(fd_);
 
   int on = 1;
   setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR,
              reinterpret_cast<char*>(&on), sizeof(on));
 
+  if (reuse_port_ &&
+      setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT,
+                 reinterpret_cast<char*>(&on), sizeof(on)) < 0) {
+    err(1, "setsockopt(SO_REUSEPORT)");
+  }
+
   if (bind(fd_, reinterpret_cast<sockaddr*>(&sin), sizeof(sin)) < 0) {
     err(1, "bind");
   }
 
-  if (listen(fd_, 16) < 0) {
+  int backlog = Config::instance().getint("listen_backlog");
+  if (backlog <= 0)
+    backlog = 16;
+
+  if (listen(fd_, backlog) < 0) {
     err(1, "listen");
   }
 
   event_set(ev_, fd_, EV_READ|EV_PERSIST, accept_cb, this);
+  event_base_set(worker_->base(), ev_);
   event_add(ev_, NULL);
 }
 
@@ -63,23 +80,35 @@ Server::~Server() {
 
 // static
 void Server::accept_cb(int listen_fd, short event, void* arg) {
+  Server* that = static_cast<Server*>(arg);
   struct sockaddr_in client_sa;
-  struct sockaddr_in server_sa;
   socklen_t slen;
   int client_fd;
 
   DLOG(2, "%s: called", __func__);
 
-  slen = sizeof(client_sa);
-  client_fd = accept(listen_fd, reinterpret_cast<sockaddr*>(&client_sa), &slen);
-  if (client_fd == -1) {
-    if (errno != EAGAIN && errno != EINTR)
-      warn("%s: bad accept", __func__);
-    return;
+  // Drain the whole backlog, a login storm queues many connections per
+  // wakeup.
+  for (;;) {
+    slen = sizeof(client_sa);
+    client_fd = accept4(listen_fd, reinterpret_cast<sockaddr*>(&client_sa),
+                        &slen, SOCK_NONBLOCK);
+    if (client_fd == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        warn("%s: bad accept", __func__);
+      break;
+    }
+
+    that->new_connection(client_fd, client_sa);
   }
+}
 
-  if (evutil_make_socket_nonblocking(client_fd) < 0)
-    return;
+void Server::new_connection(int client_fd,
+                            const struct sockaddr_in& client_sa) {
+  struct sockaddr_in server_sa;
+  socklen_t slen;
 
   Connection* conn = new Connection(client_fd);
 
@@ -115,7 +144,10 @@ void Server::accept_cb(int listen_fd, short event, void* arg) {
            conn->server_port,
            utils::ip_to_string(conn->client_addr).c_str());
 
-  conn->start();
+  if (reuse_port_)
+    worker_->dispatch(conn);
+  else
+    workers_select()->dispatch(conn);
 
   return;
 
@@ -11,18 +11,28 @@
 #include <boost/noncopyable.hpp>
 
 struct event;
+struct sockaddr_in;
+
+class Worker;
 
 // TODO: Refactor the following class.
 class Server : private boost::noncopyable {
  public:
-  Server(const char* address, int port);
+  // Listens on |worker|'s loop.  With |reuse_port| every worker has its own
+  // SO_REUSEPORT listener, the kernel balances new connections between them
+  // and each worker keeps what it accepts.
+  Server(const char* address, int port, Worker* worker, bool reuse_port);
   ~Server();
 
  private:
   static void accept_cb(int listen_fd, short event, void* arg);
 
+  void new_connection(int client_fd, const struct sockaddr_in& client_sa);
+
+  Worker* worker_;
   struct event* ev_;
   int fd_;
+  bool reuse_port_;
 };
 
 #endif // SERVER_H_
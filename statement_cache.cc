@@ -0,0 +1,228 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "statement_cache.h"
+
+#include <cstring>
+
+#include <mysql.h>
+
+#include "log.h"
+
+// ER_UNKNOWN_STMT_HANDLER
+static const int kUnknownStatement = 1243;
+// ER_NEED_REPREPARE
+static const int kNeedReprepare = 1615;
+
+StatementCache::StatementCache()
+    : mysql_(NULL),
+      insert_id_(0),
+      errno_(0) {
+}
+
+StatementCache::~StatementCache() {
+  for (StatementMap::iterator it = stmts_.begin(); it != stmts_.end(); ++it)
+    mysql_stmt_close(it->second);
+
+  if (mysql_ != NULL)
+    mysql_close(mysql_);
+}
+
+bool StatementCache::open(const std::string& name, const std::string& user,
+                          const std::string& password,
+                          const std::string& host, int port,
+                          const std::string& socket) {
+  mysql_ = mysql_init(NULL);
+  if (mysql_ == NULL) {
+    errno_ = -1;
+    error_ = "out of memory";
+    return false;
+  }
+
+  if (!mysql_real_connect(mysql_, host.empty() ? NULL : host.c_str(),
+                          user.c_str(), password.c_str(), name.c_str(),
+                          port > 0 ? port : 0,
+                          socket.empty() ? NULL : socket.c_str(), 0)) {
+    set_error();
+    return false;
+  }
+
+  errno_ = 0;
+  return true;
+}
+
+bool StatementCache::ping() {
+  if (mysql_ == NULL || mysql_ping(mysql_) != 0) {
+    set_error();
+    return false;
+  }
+  return true;
+}
+
+bool StatementCache::execute(const std::string& sql, const Params& params) {
+  MYSQL_STMT* stmt = run(sql, params);
+  if (stmt == NULL)
+    return false;
+
+  insert_id_ = mysql_stmt_insert_id(stmt);
+  mysql_stmt_free_result(stmt);
+  return true;
+}
+
+bool StatementCache::query(const std::string& sql, const Params& params,
+                           std::string& value) {
+  MYSQL_STMT* stmt = run(sql, params);
+  if (stmt == NULL)
+    return false;
+
+  char buffer[256];
+  unsigned long length = 0;
+  my_bool is_null = 0;
+
+  MYSQL_BIND result;
+  memset(&result, 0, sizeof(result));
+  result.buffer_type = MYSQL_TYPE_STRING;
+  result.buffer = buffer;
+  result.buffer_length = sizeof(buffer);
+  result.length = &length;
+  result.is_null = &is_null;
+
+  bool found = false;
+  if (mysql_stmt_field_count(stmt) == 0 ||
+      mysql_stmt_bind_result(stmt, &result) ||
+      mysql_stmt_store_result(stmt)) {
+    set_error(stmt);
+  } else {
+    int ret = mysql_stmt_fetch(stmt);
+    if (ret == 0 || ret == MYSQL_DATA_TRUNCATED) {
+      found = true;
+      if (is_null) {
+        value.clear();
+      } else if (length <= sizeof(buffer)) {
+        value.assign(buffer, length);
+      } else {
+        // too long for the buffer, fetched again in full
+        value.resize(length);
+        result.buffer = &value[0];
+        result.buffer_length = length;
+        if (mysql_stmt_fetch_column(stmt, &result, 0, 0)) {
+          set_error(stmt);
+          found = false;
+        }
+      }
+    } else if (ret != MYSQL_NO_DATA) {
+      set_error(stmt);
+    }
+  }
+
+  mysql_stmt_free_result(stmt);
+  return found;
+}
+
+MYSQL_STMT* StatementCache::prepare(const std::string& sql) {
+  StatementMap::iterator it = stmts_.find(sql);
+  if (it != stmts_.end())
+    return it->second;
+
+  if (mysql_ == NULL) {
+    errno_ = -1;
+    error_ = "not connected";
+    return NULL;
+  }
+
+  MYSQL_STMT* stmt = mysql_stmt_init(mysql_);
+  if (stmt == NULL) {
+    set_error();
+    return NULL;
+  }
+
+  if (mysql_stmt_prepare(stmt, sql.data(), sql.size())) {
+    set_error(stmt);
+    log_warn("unable to prepare '%s': MySQL error %d: %s", sql.c_str(),
+             errno_, error_.c_str());
+    mysql_stmt_close(stmt);
+    return NULL;
+  }
+
+  stmts_.insert(std::make_pair(sql, stmt));
+  DLOG(2, "prepared %s", sql.c_str());
+  return stmt;
+}
+
+MYSQL_STMT* StatementCache::run(const std::string& sql,
+                                const Params& params) {
+  errno_ = 0;
+  error_.clear();
+
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    MYSQL_STMT* stmt = prepare(sql);
+    if (stmt == NULL)
+      return NULL;
+
+    if (bind_and_execute(stmt, params))
+      return stmt;
+
+    if (errno_ == 0)
+      set_error(stmt);
+    if (errno_ != kUnknownStatement && errno_ != kNeedReprepare)
+      break;
+
+    forget(sql);
+  }
+
+  return NULL;
+}
+
+bool StatementCache::bind_and_execute(MYSQL_STMT* stmt,
+                                      const Params& params) {
+  if (mysql_stmt_param_count(stmt) != params.size()) {
+    errno_ = -1;
+    error_ = "wrong number of parameters";
+    log_warn("statement takes %lu parameters, %zu given",
+             mysql_stmt_param_count(stmt), params.size());
+    return false;
+  }
+
+  std::vector<MYSQL_BIND> binds(params.size());
+  std::vector<unsigned long> lengths(params.size());
+
+  for (size_t i = 0; i < params.size(); ++i) {
+    lengths[i] = params[i].size();
+
+    memset(&binds[i], 0, sizeof(binds[i]));
+    binds[i].buffer_type = MYSQL_TYPE_STRING;
+    binds[i].buffer = const_cast<char*>(params[i].data());
+    binds[i].buffer_length = lengths[i];
+    binds[i].length = &lengths[i];
+  }
+
+  if (!binds.empty() && mysql_stmt_bind_param(stmt, &binds[0]))
+    return false;
+
+  return mysql_stmt_execute(stmt) == 0;
+}
+
+void StatementCache::forget(const std::string& sql) {
+  StatementMap::iterator it = stmts_.find(sql);
+  if (it == stmts_.end())
+    return;
+
+  mysql_stmt_close(it->second);
+  stmts_.erase(it);
+}
+
+void StatementCache::set_error(MYSQL_STMT* stmt) {
+  errno_ = mysql_stmt_errno(stmt);
+  error_ = mysql_stmt_error(stmt);
+}
+
+void StatementCache::set_error() {
+  if (mysql_ == NULL)
+    return;
+
+  errno_ = mysql_errno(mysql_);
+  error_ = mysql_error(mysql_);
+}
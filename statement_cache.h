@@ -0,0 +1,77 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef STATEMENT_CACHE_H_
+#define STATEMENT_CACHE_H_
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+
+struct st_mysql;
+struct st_mysql_stmt;
+
+// Server-side prepared statements on a MySQL session of their own, one
+// per query text, prepared the first time the query runs.  The queries use
+// ? for their parameters, which travel in the binary protocol and are
+// never escaped.  dolphinconn only speaks the text protocol, so the
+// session is opened with the client library directly, next to the
+// dolphinconn connection of the same PooledConnection.  A reconnect
+// replaces the whole cache, so the statements are prepared again.
+class StatementCache : private boost::noncopyable {
+ public:
+  typedef std::vector<std::string> Params;
+
+  StatementCache();
+  ~StatementCache();
+
+  bool open(const std::string& name, const std::string& user,
+            const std::string& password, const std::string& host, int port,
+            const std::string& socket);
+  bool ping();
+
+  bool execute(const std::string& sql, const Params& params = Params());
+
+  // The first column of the first row of |sql| in |value|; false on error
+  // or if there is no row.
+  bool query(const std::string& sql, const Params& params,
+             std::string& value);
+
+  // of the last execute()
+  uint64_t last_insert_id() const { return insert_id_; }
+
+  // of the last call, 0 if it succeeded
+  int last_errno() const { return errno_; }
+  const char* error_msg() const { return error_.c_str(); }
+
+  size_t size() const { return stmts_.size(); }
+
+ private:
+  typedef boost::unordered_map<std::string, st_mysql_stmt*> StatementMap;
+
+  st_mysql_stmt* prepare(const std::string& sql);
+  // Prepares |sql| if needed, binds |params| and executes it, once more if
+  // the server lost the statement.  NULL on error.
+  st_mysql_stmt* run(const std::string& sql, const Params& params);
+  bool bind_and_execute(st_mysql_stmt* stmt, const Params& params);
+  void forget(const std::string& sql);
+
+  void set_error(st_mysql_stmt* stmt);
+  void set_error();
+
+  st_mysql* mysql_;
+  StatementMap stmts_;
+  uint64_t insert_id_;
+  int errno_;
+  std::string error_;
+};
+
+#endif  // STATEMENT_CACHE_H_
@@ -7,6 +7,7 @@
 #include "thread/condition.h"
 
 #include <cassert>
+#include <cerrno>
 
 #include "thread/mutex.h"
 
@@ -30,6 +31,13 @@ void Condition::wait(Mutex& m) {
   assert(rv == 0);
 }
 
+bool Condition::wait_until(MutexLocker& m, const struct timespec& deadline) {
+  int rv = pthread_cond_timedwait(&condition_, m.mutex()->mutex_handle(),
+                                  &deadline);
+  assert(rv == 0 || rv == ETIMEDOUT);
+  return rv == 0;
+}
+
 void Condition::broadcast() {
   int rv = pthread_cond_broadcast(&condition_);
   assert(rv == 0);
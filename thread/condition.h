@@ -9,6 +9,7 @@
 #pragma once
 
 #include <pthread.h>
+#include <time.h>
 #include <boost/noncopyable.hpp>
 
 class Mutex;
@@ -23,6 +24,9 @@ class Condition : private boost::noncopyable {
 
   void wait(Mutex& m);
 
+  // Returns false if |deadline| (CLOCK_REALTIME) passed first.
+  bool wait_until(MutexLocker& m, const struct timespec& deadline);
+
   void broadcast();
 
   void signal();
@@ -0,0 +1,205 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "timing_wheel.h"
+
+#include <time.h>
+
+#include <event.h>
+#include <evutil.h>
+
+WheelTimer::WheelTimer(timer_cb cb, void* arg)
+    : prev_(NULL),
+      next_(NULL),
+      wheel_(NULL),
+      expires_(0),
+      cb_(cb),
+      arg_(arg) {
+}
+
+WheelTimer::WheelTimer()
+    : prev_(this),
+      next_(this),
+      wheel_(NULL),
+      expires_(0),
+      cb_(NULL),
+      arg_(NULL) {
+}
+
+WheelTimer::~WheelTimer() {
+  if (wheel_ != NULL)
+    wheel_->cancel(this);
+}
+
+TimingWheel::TimingWheel(struct event_base* base)
+    : tick_ev_(new struct event),
+      armed_(false),
+      current_(now()),
+      size_(0) {
+  evtimer_set(tick_ev_, tick_cb, this);
+  event_base_set(base, tick_ev_);
+}
+
+TimingWheel::~TimingWheel() {
+  if (armed_)
+    evtimer_del(tick_ev_);
+  delete tick_ev_;
+
+  // the owners of what is left cancel nothing when they go
+  for (int level = 0; level < kLevels; ++level) {
+    for (int slot = 0; slot < kSlots; ++slot) {
+      WheelTimer& head = slots_[level][slot];
+      while (head.next_ != &head)
+        unlink(head.next_);
+    }
+  }
+}
+
+void TimingWheel::schedule(WheelTimer* timer, int seconds) {
+  if (timer->wheel_ != NULL)
+    timer->wheel_->cancel(timer);
+
+  const time_t now_sec = now();
+
+  // nothing to fire in between, the wheels can jump ahead
+  if (size_ == 0 && now_sec > current_)
+    current_ = now_sec;
+
+  timer->expires_ = now_sec + (seconds > 0 ? seconds : 0);
+  timer->wheel_ = this;
+  ++size_;
+  add(timer);
+
+  arm();
+}
+
+void TimingWheel::cancel(WheelTimer* timer) {
+  if (timer->wheel_ == this)
+    unlink(timer);
+}
+
+void TimingWheel::add(WheelTimer* timer) {
+  static const time_t kMaxDelta = (static_cast<time_t>(1) <<
+                                   (kBits * kLevels)) - 1;
+
+  if (timer->expires_ < current_)
+    timer->expires_ = current_;
+  else if (timer->expires_ - current_ > kMaxDelta)
+    timer->expires_ = current_ + kMaxDelta;
+
+  const time_t delta = timer->expires_ - current_;
+
+  int level = 0;
+  while (level < kLevels - 1 &&
+         delta >= (static_cast<time_t>(1) << (kBits * (level + 1))))
+    ++level;
+
+  const int slot = (timer->expires_ >> (kBits * level)) & (kSlots - 1);
+  WheelTimer& head = slots_[level][slot];
+
+  timer->prev_ = head.prev_;
+  timer->next_ = &head;
+  head.prev_->next_ = timer;
+  head.prev_ = timer;
+}
+
+void TimingWheel::unlink(WheelTimer* timer) {
+  timer->prev_->next_ = timer->next_;
+  timer->next_->prev_ = timer->prev_;
+  timer->prev_ = NULL;
+  timer->next_ = NULL;
+  timer->wheel_ = NULL;
+  --size_;
+}
+
+void TimingWheel::step() {
+  const int slot = current_ & (kSlots - 1);
+
+  if (slot == 0) {
+    for (int level = 1; level < kLevels && !cascade(level); ++level)
+      ;
+  }
+
+  // Moved on first, so that what the callbacks schedule for now lands in
+  // the next second instead of a full turn later.
+  WheelTimer expired;
+  take_list(slots_[0][slot], expired);
+  ++current_;
+
+  while (expired.next_ != &expired) {
+    WheelTimer* timer = expired.next_;
+    unlink(timer);
+    // may delete |timer|, or any other of |expired|
+    (*timer->cb_)(timer->arg_);
+  }
+}
+
+bool TimingWheel::cascade(int level) {
+  const int slot = (current_ >> (kBits * level)) & (kSlots - 1);
+
+  WheelTimer list;
+  take_list(slots_[level][slot], list);
+
+  while (list.next_ != &list) {
+    WheelTimer* timer = list.next_;
+    list.next_ = timer->next_;
+    timer->next_->prev_ = &list;
+    add(timer);
+  }
+
+  return slot != 0;
+}
+
+// static
+void TimingWheel::tick_cb(int fd, short event, void* arg) {
+  TimingWheel* that = static_cast<TimingWheel*>(arg);
+
+  that->armed_ = false;
+
+  const time_t now_sec = now();
+  while (that->current_ <= now_sec) {
+    if (that->size_ == 0) {
+      that->current_ = now_sec + 1;
+      break;
+    }
+    that->step();
+  }
+
+  that->arm();
+}
+
+void TimingWheel::arm() {
+  if (armed_ || size_ == 0)
+    return;
+
+  struct timeval tv;
+  evutil_timerclear(&tv);
+  tv.tv_sec = 1;
+
+  if (event_add(tick_ev_, &tv) == 0)
+    armed_ = true;
+}
+
+// static
+time_t TimingWheel::now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// static
+void TimingWheel::take_list(WheelTimer& head, WheelTimer& list) {
+  if (head.next_ == &head)
+    return;
+
+  list.next_ = head.next_;
+  list.prev_ = head.prev_;
+  list.next_->prev_ = &list;
+  list.prev_->next_ = &list;
+
+  head.next_ = &head;
+  head.prev_ = &head;
+}
@@ -0,0 +1,96 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef TIMING_WHEEL_H_
+#define TIMING_WHEEL_H_
+#pragma once
+
+#include <stddef.h>
+#include <ctime>
+
+#include <boost/noncopyable.hpp>
+
+struct event;
+struct event_base;
+
+class TimingWheel;
+
+// A timeout on a TimingWheel, embedded in its owner.  Destroying it
+// cancels it.
+class WheelTimer : private boost::noncopyable {
+ public:
+  typedef void (*timer_cb)(void* arg);
+
+  WheelTimer(timer_cb cb, void* arg);
+  ~WheelTimer();
+
+  bool pending() const { return wheel_ != NULL; }
+
+ private:
+  friend class TimingWheel;
+
+  // a list head
+  WheelTimer();
+
+  WheelTimer* prev_;
+  WheelTimer* next_;
+  TimingWheel* wheel_;
+  time_t expires_;
+  timer_cb cb_;
+  void* arg_;
+};
+
+// Second-resolution timeouts of one loop, in hierarchical wheels of 64
+// slots each: the first holds what expires within 64 seconds, the next
+// ones 64 times as far each, and their slots move down a wheel as they
+// come near.  Scheduling and cancelling are O(1), and the loop sees a
+// single one-second timer, armed only while some timeout is pending.
+// Not thread safe.
+class TimingWheel : private boost::noncopyable {
+ public:
+  explicit TimingWheel(struct event_base* base);
+  ~TimingWheel();
+
+  // (Re)schedules |timer| to fire in |seconds|.
+  void schedule(WheelTimer* timer, int seconds);
+  void cancel(WheelTimer* timer);
+
+  size_t size() const { return size_; }
+
+ private:
+  static const int kLevels = 4;
+  static const int kBits = 6;
+  static const int kSlots = 1 << kBits;
+
+  void add(WheelTimer* timer);
+  void unlink(WheelTimer* timer);
+
+  // Moves the timers of |head| to the empty |list|.
+  static void take_list(WheelTimer& head, WheelTimer& list);
+
+  // Fires what expires at |current_| and moves on a second.
+  void step();
+  // Spreads a slot of |level| over the wheels below; false if it was the
+  // last slot of the wheel, so the next wheel has to cascade too.
+  bool cascade(int level);
+
+  // Seconds of the monotonic clock, which steps of the wall clock don't
+  // move, like libevent's own timers.
+  static time_t now();
+
+  static void tick_cb(int fd, short event, void* arg);
+  void arm();
+
+  struct event* tick_ev_;
+  bool armed_;
+  // the second the wheels are at, fired up to the one before, on the
+  // monotonic clock
+  time_t current_;
+  size_t size_;
+  WheelTimer slots_[kLevels][kSlots];
+};
+
+#endif // TIMING_WHEEL_H_
@@ -0,0 +1,109 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+// Compares ConcurrentQueue and MpscRing the way HistoryLogger uses them:
+// several producers pushing pointers, one consumer draining batches.
+//
+//   make bench && tools/queue_bench [producers] [items per producer]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+
+#include <vector>
+
+#include "concurrent_queue.h"
+#include "mpsc_ring.h"
+#include "thread/thread.h"
+
+namespace {
+
+const size_t kCapacity = 10000;
+const size_t kBatchSize = 100;
+
+template <typename Queue>
+class Producer : public Thread {
+ public:
+  Producer(Queue& queue, long count) : queue_(queue), count_(count) { }
+
+  // Retries when full, where HistoryLogger would spool, so this measures
+  // the queue and not the disk.
+  void run() {
+    for (long i = 1; i <= count_; ++i) {
+      while (!queue_.try_push(i))
+        sched_yield();
+    }
+  }
+
+ private:
+  Queue& queue_;
+  long count_;
+};
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <typename Queue>
+double run(Queue& queue, int producers, long count) {
+  std::vector<Thread*> threads;
+  std::vector<intptr_t> batch;
+  long total = producers * count;
+
+  double start = now();
+
+  for (int i = 0; i < producers; ++i) {
+    Thread* t = new Producer<Queue>(queue, count);
+    t->set_joinable(true);
+    t->start();
+    threads.push_back(t);
+  }
+
+  for (long n = 0; n < total; n += batch.size()) {
+    batch.clear();
+    queue.pop_batch(batch, kBatchSize, 1);
+  }
+
+  double elapsed = now() - start;
+
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  return elapsed;
+}
+
+void report(const char* name, double elapsed, long total) {
+  printf("%-16s %8.3f s %12.0f items/s %8.1f ns/item\n", name, elapsed,
+         total / elapsed, elapsed * 1e9 / total);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int producers = argc > 1 ? atoi(argv[1]) : 4;
+  long count = argc > 2 ? atol(argv[2]) : 1000000;
+  long total = producers * count;
+
+  printf("%d producers, %ld items each\n", producers, count);
+
+  {
+    ConcurrentQueue<intptr_t> queue(kCapacity);
+    report("ConcurrentQueue", run(queue, producers, count), total);
+  }
+
+  {
+    MpscRing<intptr_t> queue(kCapacity);
+    report("MpscRing", run(queue, producers, count), total);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+// Compares reading the contacts of a login ADL through a libxml2 document
+// tree, as adl_cmd used to, with msn::parse_adl().
+//
+//   make bench && tools/xml_bench [contacts] [rounds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include <libxml/parser.h>
+
+#include "msn/xml_payload.h"
+
+namespace {
+
+// |count| contacts over a few domains, one in ten of them a circle.
+std::string make_adl(int count) {
+  static const char* const kDomains[] = {
+    "hotmail.com", "live.com", "msn.com", "example.com"
+  };
+
+  std::string adl = "<ml l=\"1\">";
+  for (int d = 0; d < 4; ++d) {
+    adl += "<d n=\"";
+    adl += kDomains[d];
+    adl += "\">";
+    for (int i = d; i < count; i += 4) {
+      char contact[64];
+      snprintf(contact, sizeof(contact),
+               "<c n=\"contact%d\" l=\"3\" t=\"%d\"/>", i, i % 10 ? 1 : 9);
+      adl += contact;
+    }
+    adl += "</d>";
+  }
+  adl += "</ml>";
+  return adl;
+}
+
+size_t dom_contacts(const std::string& data) {
+  size_t count = 0;
+
+  xmlDocPtr doc = xmlReadMemory(data.c_str(), static_cast<int>(data.size()),
+                                "", NULL, 0);
+  if (!doc)
+    return 0;
+
+  xmlNodePtr adl = xmlDocGetRootElement(doc);
+  for (xmlNodePtr domain = adl->children; domain; domain = domain->next) {
+    xmlChar* domain_name = xmlGetProp(domain,
+                                      reinterpret_cast<const xmlChar*>("n"));
+    if (!domain_name)
+      continue;
+
+    for (xmlNodePtr contact = domain->children; contact;
+         contact = contact->next) {
+      xmlChar* name = xmlGetProp(contact,
+                                 reinterpret_cast<const xmlChar*>("n"));
+      xmlChar* type = xmlGetProp(contact,
+                                 reinterpret_cast<const xmlChar*>("t"));
+      if (name && type) {
+        int t = strtol(reinterpret_cast<char*>(type), NULL, 10);
+        if (t != 9 && t != 32) {
+          std::string email = reinterpret_cast<char*>(name);
+          email += "@";
+          email += reinterpret_cast<char*>(domain_name);
+          ++count;
+        }
+      }
+      xmlFree(name);
+      xmlFree(type);
+    }
+    xmlFree(domain_name);
+  }
+
+  xmlFreeDoc(doc);
+  return count;
+}
+
+size_t sax_contacts(const std::string& data) {
+  std::vector<std::string> contacts;
+  msn::parse_adl(data.data(), data.size(), contacts);
+  return contacts.size();
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run(const char* name, size_t (*parse)(const std::string&),
+         const std::string& adl, int rounds) {
+  size_t count = 0;
+
+  double start = now();
+  for (int i = 0; i < rounds; ++i)
+    count = parse(adl);
+  double elapsed = now() - start;
+
+  printf("%-6s %8.3f ms/ADL %8zu contacts\n", name,
+         elapsed * 1e3 / rounds, count);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  int count = argc > 1 ? atoi(argv[1]) : 5000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 200;
+
+  xmlInitParser();
+
+  const std::string adl = make_adl(count);
+  printf("%d contacts, %zu bytes, %d rounds\n", count, adl.size(), rounds);
+
+  run("DOM", &dom_contacts, adl, rounds);
+  run("SAX", &sax_contacts, adl, rounds);
+
+  xmlCleanupParser();
+  return EXIT_SUCCESS;
+}
@@ -14,6 +14,9 @@
 #include <arpa/inet.h>
 
 #include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <dolphinconn/connection.h>
+#include <dolphinconn/resultset.h>
 #include <openssl/buffer.h>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
@@ -192,4 +195,19 @@ std::string ip_to_string(uint32_t addr) {
   return ip;
 }
 
+std::string table_fingerprint(dolphinconn::Connection& db,
+                              const std::string& sql) {
+  boost::scoped_ptr<dolphinconn::ResultSet> res(db.execute_query(sql));
+  if (!res || !res->step())
+    return "";
+
+  return res->column_string(0) + ":" + res->column_string(1) + ":" +
+         res->column_string(2);
+}
+
+uint32_t fingerprint_max_id(const std::string& fp) {
+  size_t begin = fp.find(':') + 1;
+  return strtoul(fp.c_str() + begin, NULL, 10);
+}
+
 } // namespace utils
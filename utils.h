@@ -11,6 +11,10 @@
 #include <inttypes.h>
 #include <string>
 
+namespace dolphinconn {
+class Connection;
+}
+
 namespace utils {
 
 std::string decode_url(const std::string& url);
@@ -21,6 +25,12 @@ std::string u16_to_u8(const uint16_t* src, size_t n);
 bool match(const std::string& str, const std::string& against);
 std::string ip_to_string(uint32_t addr);
 
+// "count:max(id):checksum" of the rows selected by |sql|, or an empty
+// string on error.
+std::string table_fingerprint(dolphinconn::Connection& db,
+                              const std::string& sql);
+uint32_t fingerprint_max_id(const std::string& fp);
+
 } // namespace utils
 
 #endif // UTILS_H_
@@ -0,0 +1,131 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "wildcard_index.h"
+
+#include <cctype>
+
+#include <algorithm>
+
+#include "utils.h"
+
+namespace {
+
+typedef std::pair<unsigned char, uint32_t> Edge;
+
+struct EdgeLess {
+  bool operator()(const Edge& e, unsigned char c) const {
+    return e.first < c;
+  }
+};
+
+std::string lower(const std::string& s) {
+  std::string ret(s);
+  for (size_t i = 0; i < ret.size(); ++i)
+    ret[i] = tolower(static_cast<unsigned char>(ret[i]));
+  return ret;
+}
+
+}  // namespace
+
+WildcardIndex::WildcardIndex()
+    : suffixes_(1) {
+}
+
+size_t WildcardIndex::add(const std::string& pattern) {
+  std::string key = lower(pattern);
+
+  PatternMap::const_iterator found = ids_.find(key);
+  if (found != ids_.end())
+    return found->second;
+
+  size_t id = ids_.size();
+  ids_[key] = id;
+
+  size_t star = key.find('*');
+  if (star == std::string::npos) {
+    literals_[key] = id;
+  } else if (star == 0 && key.find('*', 1) == std::string::npos) {
+    // "*" alone ends at the root
+    uint32_t node = 0;
+    for (size_t i = key.size() - 1; i > 0; --i) {
+      unsigned char c = key[i];
+
+      std::vector<Edge>& next = suffixes_[node].next;
+      std::vector<Edge>::iterator it =
+          std::lower_bound(next.begin(), next.end(), c, EdgeLess());
+      if (it != next.end() && it->first == c) {
+        node = it->second;
+      } else {
+        uint32_t n = suffixes_.size();
+        next.insert(it, Edge(c, n));
+        suffixes_.push_back(Node());
+        node = n;
+      }
+    }
+    suffixes_[node].id = id;
+  } else {
+    others_.push_back(std::make_pair(pattern, id));
+  }
+
+  return id;
+}
+
+bool WildcardIndex::lookup(const std::string& str,
+                           std::vector<size_t>* ids) const {
+  std::string key = lower(str);
+  bool found = false;
+
+  PatternMap::const_iterator it = literals_.find(key);
+  if (it != literals_.end()) {
+    if (ids == NULL)
+      return true;
+    ids->push_back(it->second);
+    found = true;
+  }
+
+  // every node on the way is a suffix of |str|
+  uint32_t node = 0;
+  for (size_t i = key.size(); ; --i) {
+    if (suffixes_[node].id != kNone) {
+      if (ids == NULL)
+        return true;
+      ids->push_back(suffixes_[node].id);
+      found = true;
+    }
+
+    if (i == 0)
+      break;
+
+    const std::vector<Edge>& next = suffixes_[node].next;
+    std::vector<Edge>::const_iterator e =
+        std::lower_bound(next.begin(), next.end(),
+                         static_cast<unsigned char>(key[i - 1]), EdgeLess());
+    if (e == next.end() || e->first != static_cast<unsigned char>(key[i - 1]))
+      break;
+    node = e->second;
+  }
+
+  for (size_t i = 0; i < others_.size(); ++i) {
+    if (utils::match(str, others_[i].first)) {
+      if (ids == NULL)
+        return true;
+      ids->push_back(others_[i].second);
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+void WildcardIndex::find(const std::string& str,
+                         std::vector<size_t>& ids) const {
+  lookup(str, &ids);
+}
+
+bool WildcardIndex::matches(const std::string& str) const {
+  return lookup(str, NULL);
+}
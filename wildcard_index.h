@@ -0,0 +1,60 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef WILDCARD_INDEX_H_
+#define WILDCARD_INDEX_H_
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+// A set of utils::match() patterns, indexed so that finding those matching
+// a string doesn't depend on how many there are: literals are hashed and
+// "*suffix" patterns (like *@contoso.com) live in a trie of reversed
+// suffixes.  Only patterns with a '*' anywhere else are tried one by one.
+class WildcardIndex {
+ public:
+  WildcardIndex();
+
+  // Returns the id of |pattern|, the same for the same pattern (ignoring
+  // case).  Ids are numbered from 0.
+  size_t add(const std::string& pattern);
+
+  // Appends the ids of the patterns matching |str| to |ids|.
+  void find(const std::string& str, std::vector<size_t>& ids) const;
+
+  bool matches(const std::string& str) const;
+
+  size_t size() const { return ids_.size(); }
+
+ private:
+  typedef boost::unordered_map<std::string, size_t> PatternMap;
+
+  struct Node {
+    Node() : id(kNone) { }
+
+    // sorted by character
+    std::vector<std::pair<unsigned char, uint32_t> > next;
+    size_t id;
+  };
+
+  static const size_t kNone = static_cast<size_t>(-1);
+
+  // Stops at the first match if |ids| is NULL.
+  bool lookup(const std::string& str, std::vector<size_t>* ids) const;
+
+  PatternMap ids_;
+  PatternMap literals_;
+  std::vector<Node> suffixes_;
+  std::vector<std::pair<std::string, size_t> > others_;
+};
+
+#endif  // WILDCARD_INDEX_H_
@@ -7,117 +7,255 @@
 #include "word_filter.h"
 
 #include <ctime>
-#include <cctype>
+#include <cstring>
 
-#include <algorithm>
-#include <set>
 #include <vector>
 
+#include <boost/lexical_cast.hpp>
 #include <boost/regex.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <dolphinconn/connection.h>
 #include <dolphinconn/resultset.h>
 #include <event.h>
 #include <evutil.h>
 
-#include "tokenizer.h"
+#include "connection_pool.h"
+#include "reloader.h"
+#include "aho_corasick.h"
 #include "config.h"
 #include "utils.h"
 #include "log.h"
 
-namespace {
+typedef std::vector<boost::regex> pattern_list;
 
-struct ltstr {
-  static bool nocase_compare(char c1, char c2) {
-    return std::tolower(c1) < std::tolower(c2);
-  }
-  bool operator()(const std::string& s1, const std::string& s2) const {
-    return std::lexicographical_compare(s1.begin(), s1.end(),
-                                        s2.begin(), s2.end(),
-                                        nocase_compare);
-  }
+// The badwords, replaced as a whole by every reload so the workers never
+// see a half-built list.  The literal words are one automaton and the
+// patterns, where possible, one alternation, so a message is scanned once
+// for the words and once for the patterns.
+struct WordList {
+  AhoCorasick words;
+  // the sources of |combined|
+  std::vector<std::string> alternatives;
+  boost::regex combined;
+  // the patterns that can't be part of |combined|
+  pattern_list patterns;
 };
 
-}  // namespace
+typedef boost::shared_ptr<const WordList> WordListPointer;
+
+static WordListPointer current(new WordList);
 
-typedef std::set<std::string, ltstr> word_set;
-typedef std::vector<std::string> pattern_list;
+static const char* const kWordsFingerprintSql = "SELECT COUNT(*), MAX(id), "
+    "BIT_XOR(CRC32(CONCAT_WS(':', id, badword, isregex))) FROM badwords "
+    "WHERE isenabled = 1";
 
-static word_set words;
-static pattern_list patterns;
+// of the badwords |current| was loaded from; only used by the reloads
+static std::string current_fp;
 
 static struct event ev_timeout;
+static int reload_interval = 300;
 
-static bool load_words(word_set& foo, pattern_list& bar) {
-  Config& config = Config::instance();
-  boost::scoped_ptr<dolphinconn::Connection> db(new dolphinconn::Connection);
-  if (!db->open(config["db_name"], config["db_user"], config["db_password"],
-        config["db_host"], config.getint("db_port"), config["db_socket"])) {
-    log_warn("MySQL error %d, SQLState %s: %s", db->get_last_errno(),
-             db->get_sqlstate(), db->get_error_msg());
-    return false;
+static const boost::regex::flag_type kRegexFlags =
+    boost::regex::perl|boost::regex::icase|boost::regex::no_except;
+
+// Group numbers and names change inside an alternation, so patterns that
+// refer to their groups must be matched on their own.
+static bool can_combine(const std::string& pattern) {
+  static const char* const kGroupRefs[] = {
+    "\\1", "\\2", "\\3", "\\4", "\\5", "\\6", "\\7", "\\8", "\\9",
+    "\\g", "\\k", "(?P", "(?&", "(?R", "(?(", "(?'", NULL
+  };
+
+  for (size_t i = 0; kGroupRefs[i] != NULL; ++i) {
+    if (pattern.find(kGroupRefs[i]) != std::string::npos)
+      return false;
   }
 
-  boost::scoped_ptr<dolphinconn::ResultSet> res(db->execute_query("SELECT "
-        "badword, isregex FROM badwords WHERE isenabled = 1"));
+  // named groups, but not lookbehinds
+  for (size_t pos = pattern.find("(?<"); pos != std::string::npos;
+       pos = pattern.find("(?<", pos + 1)) {
+    if (pos + 3 >= pattern.size() || !strchr("=!", pattern[pos + 3]))
+      return false;
+  }
+
+  return true;
+}
+
+namespace {
+
+struct WordRow {
+  WordRow(const std::string& w, bool r) : word(w), regex(r) {}
+
+  std::string word;
+  bool regex;
+};
+
+// What a reload read: all the badwords, or only those added since
+// |current| was loaded.
+struct WordChanges {
+  WordChanges() : incremental(false) {}
+
+  std::string fp;
+  bool incremental;
+  std::vector<WordRow> rows;
+};
+
+}  // namespace
+
+static bool load_words(dolphinconn::Connection& db, const std::string& where,
+                       std::vector<WordRow>& rows) {
+  boost::scoped_ptr<dolphinconn::ResultSet> res(db.execute_query("SELECT "
+        "badword, isregex FROM badwords WHERE isenabled = 1" + where));
   if (!res)
     return false;
 
-  std::string tmp;
-  while (res->step()) {
-    tmp = res->column_string(0);
-    if (res->column_int(1) == 0)
-      foo.insert(tmp);
+  while (res->step())
+    rows.push_back(WordRow(res->column_string(0), res->column_int(1) != 0));
+  return true;
+}
+
+// Adds |rows| to |list|; compile() makes them usable.
+static void add_words(WordList& list, const std::vector<WordRow>& rows) {
+  size_t bad = 0, good = 0, unmatchable = 0;
+  for (size_t i = 0; i < rows.size(); ++i) {
+    const std::string& tmp = rows[i].word;
+    if (!rows[i].regex) {
+      // messages are matched token by token
+      if (!list.words.add(tmp))
+        ++unmatchable;
+      continue;
+    }
+
+    boost::regex re(tmp, kRegexFlags);
+    if (re.status() != 0) {
+      log_warn("badword pattern '%s' doesn't compile", tmp.c_str());
+      ++bad;
+      continue;
+    }
+
+    ++good;
+    if (can_combine(tmp))
+      list.alternatives.push_back(tmp);
     else
-      bar.push_back(tmp);
+      list.patterns.push_back(re);
   }
 
-  return true;
+  if (bad)
+    log_warn("%zu of %zu badword patterns ignored", bad, bad + good);
+  if (unmatchable)
+    log_warn("%zu badwords with spaces or punctuation ignored, use a "
+             "pattern instead", unmatchable);
+}
+
+static void compile(WordList& list) {
+  list.words.build();
+
+  if (list.alternatives.empty())
+    return;
+
+  std::string combined;
+  for (size_t i = 0; i < list.alternatives.size(); ++i) {
+    combined += i ? "|(?:" : "(?:";
+    combined += list.alternatives[i];
+    combined += ")";
+  }
+
+  list.combined.assign(combined, kRegexFlags);
+  if (list.combined.status() != 0) {
+    log_warn("unable to combine %zu badword patterns, matching them one "
+             "by one", list.alternatives.size());
+    list.combined = boost::regex();
+    for (size_t i = 0; i < list.alternatives.size(); ++i) {
+      list.patterns.push_back(boost::regex(list.alternatives[i],
+                                           kRegexFlags));
+    }
+    list.alternatives.clear();
+  }
+}
+
+// Reads the badwords if they changed since |current| was loaded; false if
+// they didn't or can't be read.
+static bool read_changes(dolphinconn::Connection& db, WordChanges& changes) {
+  changes.fp = utils::table_fingerprint(db, kWordsFingerprintSql);
+  if (changes.fp.empty())
+    return false;
+
+  if (changes.fp == current_fp) {
+    DLOG(1, "badwords unchanged");
+    return false;
+  }
+
+  uint32_t old_max = utils::fingerprint_max_id(current_fp);
+  std::string max = boost::lexical_cast<std::string>(old_max);
+
+  // Usually words were only added; then only the new ones are fetched.
+  changes.incremental =
+      !current_fp.empty() && old_max < utils::fingerprint_max_id(changes.fp) &&
+      utils::table_fingerprint(db, kWordsFingerprintSql +
+                               (" AND id <= " + max)) == current_fp;
+
+  return load_words(db, changes.incremental ? " AND id > " + max : "",
+                    changes.rows);
+}
+
+static void reload() {
+  WordChanges changes;
+  {
+    ConnectionLease conn;
+    if (!conn->connected() || !read_changes(conn->db(), changes))
+      return;
+  }
+
+  // The connection is back in the pool while the automaton and the
+  // patterns are built; the loops use the old list until the new one is
+  // swapped in.
+  WordList* list = changes.incremental
+      ? new WordList(*boost::atomic_load(&current)) : new WordList;
+  add_words(*list, changes.rows);
+  compile(*list);
+
+  current_fp = changes.fp;
+  boost::atomic_store(&current, WordListPointer(list));
 }
 
 static void reload_words(int fd, short event, void* arg) {
   struct timeval tv;
 
   evutil_timerclear(&tv);
-  tv.tv_sec = 300;  // TODO: hardcoded.
+  tv.tv_sec = reload_interval;
   event_add(&ev_timeout, &tv);
 
   DLOG(1, "--== Reloading words ==--");
 
-  word_set foo;
-  pattern_list bar;
-
-  if (!load_words(foo, bar))
-    return;
-
-  words.swap(foo);
-  patterns.swap(bar);
+  Reloader::instance()->submit(reload);
 }
 
 void word_filter_init() {
   struct timeval tv;
 
+  int interval = Config::instance().getint("badword_refresh_interval");
+  if (interval > 0)
+    reload_interval = interval;
+
+  // initial load
+  reload();
+
   evtimer_set(&ev_timeout, reload_words, NULL);
   evutil_timerclear(&tv);
-  tv.tv_sec = 300;  // TODO: hardcoded.
+  tv.tv_sec = reload_interval;
   event_add(&ev_timeout, &tv);
-
-  // initial load
-  load_words(words, patterns);
 }
 
 bool word_filter_check(const std::string& str) {
-  tokenizer<> t(str);
-  while (t.has_next()) {
-    if (words.count(t.token()))
-      return true;
-  }
-  boost::regex re;
-  for (size_t i = 0; i < patterns.size(); ++i) {
-    re.assign(patterns[i], boost::regex::perl|boost::regex::icase|boost::regex::no_except);
-    if (re.empty())
-      continue;
-    if (boost::regex_match(str, re))
+  const WordListPointer list = boost::atomic_load(&current);
+
+  if (list->words.find_token(str))
+    return true;
+  if (!list->combined.empty() && boost::regex_match(str, list->combined))
+    return true;
+  for (size_t i = 0; i < list->patterns.size(); ++i) {
+    if (boost::regex_match(str, list->patterns[i]))
       return true;
   }
   return false;
@@ -10,6 +10,7 @@
 
 #include <string>
 
+// Reloads run on the Reloader.
 void word_filter_init();
 bool word_filter_check(const std::string& str);
 
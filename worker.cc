@@ -0,0 +1,288 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#include "worker.h"
+
+#include <err.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <event.h>
+#include <evutil.h>
+
+#include "connection.h"
+#include "server.h"
+#include "timing_wheel.h"
+#include "config.h"
+#include "log.h"
+
+namespace {
+
+static __thread Worker* current_worker = NULL;
+
+static Worker* main_worker = NULL;
+static std::vector<Worker*> workers;
+static size_t next_worker = 0;
+static bool least_loaded = false;
+
+}  // namespace
+
+Worker::Worker(struct event_base* base)
+    : base_(base),
+      notify_ev_(new struct event),
+      timers_(NULL),
+      server_(NULL),
+      cpu_(-1),
+      load_(0),
+      owns_base_(false) {
+  init();
+  current_worker = this;
+}
+
+Worker::Worker(int cpu)
+    : base_(event_base_new()),
+      notify_ev_(new struct event),
+      timers_(NULL),
+      server_(NULL),
+      cpu_(cpu),
+      load_(0),
+      owns_base_(true) {
+  if (base_ == NULL)
+    errx(1, "%s: event_base_new failed", __func__);
+  init();
+}
+
+void Worker::init() {
+  if (pipe(notify_fd_) == -1)
+    err(1, "%s: pipe", __func__);
+
+  // A full pipe must not block the posting thread, a database thread for
+  // instance; the task goes to the overflow queue instead.
+  evutil_make_socket_nonblocking(notify_fd_[0]);
+  evutil_make_socket_nonblocking(notify_fd_[1]);
+
+  event_set(notify_ev_, notify_fd_[0], EV_READ|EV_PERSIST, notify_cb, this);
+  event_base_set(base_, notify_ev_);
+  event_add(notify_ev_, NULL);
+
+  timers_ = new TimingWheel(base_);
+}
+
+Worker::~Worker() {
+  delete server_;
+  delete timers_;
+
+  event_del(notify_ev_);
+  delete notify_ev_;
+
+  close(notify_fd_[0]);
+  close(notify_fd_[1]);
+
+  if (owns_base_)
+    event_base_free(base_);
+}
+
+// static
+Worker* Worker::current() {
+  return current_worker;
+}
+
+void Worker::run() {
+  current_worker = this;
+
+  if (cpu_ >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu_, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+      log_warn("%s: unable to pin worker to cpu %d", __func__, cpu_);
+  }
+
+  event_base_dispatch(base_);
+
+  close_connections();
+}
+
+void Worker::stop() {
+  post(exit_cb, this);
+}
+
+void Worker::post(task_cb cb, void* arg) {
+  Task task = { cb, arg };
+
+  // Held across the write, so that a task is queued only while the pipe
+  // is full, and the worker, which drains the queue after the pipe, is
+  // sure to wake up for it.
+  MutexLocker lock(overflow_mutex_);
+
+  if (!overflow_.empty()) {
+    overflow_.push_back(task);
+    return;
+  }
+
+  // Writes smaller than PIPE_BUF are atomic, so producers never interleave.
+  ssize_t n;
+  do {
+    n = write(notify_fd_[1], &task, sizeof(task));
+  } while (n == -1 && errno == EINTR);
+
+  if (n == sizeof(task))
+    return;
+
+  if (n == -1 && errno == EAGAIN) {
+    overflow_.push_back(task);
+    DLOG(1, "%s: pipe full, %zu tasks queued", __func__, overflow_.size());
+  } else {
+    log_warn("%s: unable to notify worker", __func__);
+  }
+}
+
+void Worker::dispatch(Connection* conn) {
+  conn->worker = this;
+  post(start_cb, conn);
+}
+
+void Worker::listen(const char* address, int port, bool reuse_port) {
+  server_ = new Server(address, port, this, reuse_port);
+}
+
+void Worker::attach(Connection* conn) {
+  // counted once started, so that one lost on the way isn't
+  if (connections_.insert(conn).second)
+    __sync_fetch_and_add(&load_, 1);
+}
+
+void Worker::detach(Connection* conn) {
+  if (connections_.erase(conn))
+    __sync_fetch_and_sub(&load_, 1);
+}
+
+bool Worker::has(const Connection* conn, uint32_t id) const {
+  // Compare the id too, the address may belong to a newer connection.
+  return connections_.count(const_cast<Connection*>(conn)) > 0 &&
+         conn->id == id;
+}
+
+void Worker::close_connections() {
+  DLOG(2, "%s: called", __func__);
+
+  // Connections still queued are started, and so closed below, instead of
+  // leaking.
+  run_tasks();
+
+  std::set<Connection*>::iterator c, nxt;
+
+  for (c = connections_.begin(); c != connections_.end(); c = nxt) {
+    nxt = c;
+    ++nxt;
+    delete *c;
+  }
+
+  connections_.clear();
+}
+
+void Worker::run_tasks() {
+  Task task;
+
+  while (read(notify_fd_[0], &task, sizeof(task)) == sizeof(task))
+    (*task.cb)(task.arg);
+
+  std::deque<Task> tasks;
+  {
+    MutexLocker lock(overflow_mutex_);
+    tasks.swap(overflow_);
+  }
+
+  for (size_t i = 0; i < tasks.size(); ++i)
+    (*tasks[i].cb)(tasks[i].arg);
+}
+
+// static
+void Worker::notify_cb(int fd, short event, void* arg) {
+  Worker* that = static_cast<Worker*>(arg);
+  that->run_tasks();
+}
+
+// static
+void Worker::start_cb(void* arg) {
+  Connection* conn = static_cast<Connection*>(arg);
+  conn->start();
+}
+
+// static
+void Worker::exit_cb(void* arg) {
+  Worker* that = static_cast<Worker*>(arg);
+  event_base_loopexit(that->base_, NULL);
+}
+
+void workers_init(struct event_base* base, const char* address, int port) {
+  Config& config = Config::instance();
+
+  main_worker = new Worker(base);
+
+  const int count = config.getint("workers");
+  const bool reuse_port = config.getint("listen_reuseport") != 0;
+  const bool pin = config.getint("worker_affinity") != 0;
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  least_loaded = config["worker_dispatch"] == "leastloaded";
+
+  for (int i = 0; i < count; ++i) {
+    workers.push_back(new Worker(pin && cpus > 0 ? static_cast<int>(i % cpus)
+                                                 : -1));
+  }
+
+  if (reuse_port && !workers.empty()) {
+    for (size_t i = 0; i < workers.size(); ++i)
+      workers[i]->listen(address, port, true);
+  } else {
+    main_worker->listen(address, port, reuse_port);
+  }
+
+  for (size_t i = 0; i < workers.size(); ++i) {
+    workers[i]->set_joinable(true);
+    workers[i]->start();
+  }
+
+  if (!workers.empty()) {
+    log_info("started %zu workers (%s)", workers.size(),
+             reuse_port ? "SO_REUSEPORT" :
+             least_loaded ? "least loaded" : "round robin");
+  }
+}
+
+void workers_shutdown() {
+  for (size_t i = 0; i < workers.size(); ++i) {
+    workers[i]->stop();
+    workers[i]->join();
+    delete workers[i];
+  }
+  workers.clear();
+
+  if (main_worker) {
+    main_worker->close_connections();
+    delete main_worker;
+    main_worker = NULL;
+  }
+}
+
+Worker* workers_select() {
+  if (workers.empty())
+    return main_worker;
+
+  if (!least_loaded)
+    return workers[next_worker++ % workers.size()];
+
+  Worker* best = workers[0];
+  for (size_t i = 1; i < workers.size(); ++i) {
+    if (workers[i]->load() < best->load())
+      best = workers[i];
+  }
+  return best;
+}
@@ -0,0 +1,103 @@
+/* vim:set ts=2 sw=2 et cindent: */
+/*
+ * Copyright (c) 2011 William Lima <wlima@primate.com.br>
+ * All rights reserved.
+ */
+
+#ifndef WORKER_H_
+#define WORKER_H_
+#pragma once
+
+#include <stdint.h>
+
+#include <deque>
+#include <set>
+
+#include "thread/mutex.h"
+#include "thread/thread.h"
+
+struct event;
+struct event_base;
+
+class Connection;
+class Server;
+class TimingWheel;
+
+// An event loop owning a share of the connections.  A connection, its
+// bufferevents and its chat timers only ever live on one worker, so that
+// state is never touched by two threads.
+class Worker : public Thread {
+ public:
+  typedef void (*task_cb)(void* arg);
+
+  // Wraps the loop of the calling thread (no thread is started).
+  explicit Worker(struct event_base* base);
+
+  // Creates a loop of its own, pinned to |cpu| if it is not negative.
+  explicit Worker(int cpu);
+
+  ~Worker();
+
+  // The worker whose loop runs on the calling thread.
+  static Worker* current();
+
+  void run();
+  void stop();
+
+  // Runs |cb| on this worker's thread.  May be called from any thread.
+  void post(task_cb cb, void* arg);
+
+  // Hands an accepted connection over to this worker.
+  void dispatch(Connection* conn);
+
+  // Opens a listener on this worker's loop.  Must be called before the
+  // worker is started.
+  void listen(const char* address, int port, bool reuse_port);
+
+  void attach(Connection* conn);
+  void detach(Connection* conn);
+
+  // Whether |conn| is still alive on this worker.
+  bool has(const Connection* conn, uint32_t id) const;
+
+  void close_connections();
+
+  struct event_base* base() const { return base_; }
+  // the idle timeouts of this loop
+  TimingWheel& timers() { return *timers_; }
+  uint32_t load() const { return load_; }
+
+ private:
+  struct Task {
+    task_cb cb;
+    void* arg;
+  };
+
+  void init();
+
+  // Runs the tasks posted so far.
+  void run_tasks();
+
+  static void notify_cb(int fd, short event, void* arg);
+  static void start_cb(void* arg);
+  static void exit_cb(void* arg);
+
+  struct event_base* base_;
+  struct event* notify_ev_;
+  TimingWheel* timers_;
+  Server* server_;
+  std::set<Connection*> connections_;
+  int notify_fd_[2];
+  // tasks posted while the pipe was full, run after those in the pipe
+  Mutex overflow_mutex_;
+  std::deque<Task> overflow_;
+  int cpu_;
+  volatile uint32_t load_;
+  bool owns_base_;
+};
+
+void workers_init(struct event_base* base, const char* address, int port);
+void workers_shutdown();
+Worker* workers_select();
+
+#endif // WORKER_H_